@@ -7,6 +7,8 @@
 #ifndef MONITOR_H
 #define MONITOR_H
 
-void monitor_main_loop(int socket_fd);
+#include "client/transport.h"
+
+void monitor_main_loop(Transport *transport);
 
 #endif /* MONITOR_H */
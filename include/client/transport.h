@@ -0,0 +1,39 @@
+/**
+ * @file     transport.h
+ * @author   whz
+ * @brief    客户端与服务器之间的传输方式
+ */
+
+#ifndef CLIENT_TRANSPORT_H
+#define CLIENT_TRANSPORT_H
+
+#include <lib/proxy.h>
+
+/**
+ * @brief 传输方式，控制台只通过 roundtrip 收发报文
+ */
+typedef struct Transport {
+    /**
+     * 发送网络字节序的请求并等待响应，响应同样为网络字节序，
+     * 成功时返回 0，失败时返回 -1
+     */
+    int (*roundtrip)(struct Transport *transport, const CityRequestHeader *request, CityResponseHeader *response);
+    void *context;
+} Transport;
+
+/**
+ * 基于已连接 TCP 套接字的传输
+ */
+Transport *tcp_transport(int socket_fd);
+
+/**
+ * 基于共享内存的传输，连接失败时返回 NULL
+ */
+Transport *shm_transport(const char *path);
+
+/**
+ * 连接多个服务器，按延迟选择并对冲请求的传输，没有服务器可以连接时返回 NULL
+ */
+Transport *multi_transport(int n_address, char *addresses[]);
+
+#endif /* CLIENT_TRANSPORT_H */
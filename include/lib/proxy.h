@@ -12,12 +12,30 @@
 #define REQUEST_CITY          0x0101
 #define REQUEST_SINGLE_DAY    0x0201
 #define REQUEST_MULTIPLE_DAY  0x0202
+#define REQUEST_INGEST        0x0301
+#define REQUEST_SUBSCRIBE     0x0401
+#define REQUEST_UNSUBSCRIBE   0x0402
+#define REQUEST_PREFIX        0x0501
 
 #define RESPONSE_CITY_EXISTS  0x0100
 #define RESPONSE_NO_CITY      0x0200
 #define RESPONSE_SINGLE_DAY   0x0341
 #define RESPONSE_MULTIPLE_DAY 0x0342
 #define RESPONSE_NO_DAY       0x0441
+#define RESPONSE_INGEST_DONE  0x0500
+#define RESPONSE_INGEST_DENY  0x0600
+#define RESPONSE_SUBSCRIBED   0x0700
+#define RESPONSE_UNSUBSCRIBED 0x0800
+#define RESPONSE_SUBSCRIBE_FULL 0x0900
+#define RESPONSE_PUSH_UPDATE  0x0a41
+#define RESPONSE_THROTTLED    0x0b00
+#define RESPONSE_PREFIX       0x0c00
+#define RESPONSE_UNSUPPORTED  0x0d00
+
+/**
+ * @brief 前缀查询一次最多返回的城市数
+ */
+#define MAX_PREFIX_MATCH      32
 
 /**
  * @brief 客户端请求通用结构
@@ -30,6 +48,16 @@ typedef struct {
 } CityRequestHeader;
 #pragma pack(pop)
 
+/**
+ * @brief 单日天气状态
+ */
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t weather_type;      /**< 天气类型 */
+    int8_t  temperature;       /**< 温度 */
+} WeatherStatus;
+#pragma pack(pop)
+
 /**
  * @brief 服务器响应通用结构
  */
@@ -41,13 +69,39 @@ typedef struct {
     uint8_t   month;           /**< 月份 */
     uint8_t   day;             /**< 日期 */
     uint8_t   n_status;        /**< 包含的状态数，决定 #status 数据有效元素的个数 */
-    struct {
-        uint8_t weather_type;  /**< 天气类型 */
-        int8_t temperature;    /**< 温度 */
-    } status[25];              /**< 状态数组 */
+    WeatherStatus status[25];  /**< 状态数组 */
 } CityResponseHeader;
 #pragma pack(pop)
 
+/**
+ * @brief 天气录入记录
+ *
+ * 录入请求以 type 为 #REQUEST_INGEST 的 CityRequestHeader 开头，
+ * 其 date 字段表示紧随其后的记录条数，city_name 字段不使用。
+ * 记录中没有多字节字段，无需转换字节序。
+ */
+#pragma pack(push, 1)
+typedef struct {
+    char      city_name[20];   /**< 城市名称，含终结符 */
+    uint8_t   date;            /**< 日期距离，含义同 CityRequestHeader::date */
+    uint8_t   weather_type;    /**< 天气类型 */
+    int8_t    temperature;     /**< 温度 */
+} WeatherIngestRecord;
+#pragma pack(pop)
+
+/**
+ * @brief 前缀查询结果中的城市名
+ *
+ * 前缀查询以 type 为 #REQUEST_PREFIX 的 CityRequestHeader 发出，city_name 为前缀，
+ * date 为最多返回的城市数。响应为 type 为 #RESPONSE_PREFIX 的 CityResponseHeader，
+ * 其 n_status 字段表示紧随其后的记录条数，记录按城市名升序排列。
+ */
+#pragma pack(push, 1)
+typedef struct {
+    char      city_name[20];   /**< 城市名称，含终结符 */
+} CityNameRecord;
+#pragma pack(pop)
+
 /**
  * @brief weather_type 的值对应的枚举值
  *
@@ -67,7 +121,7 @@ CityRequestHeader *construct_request(CityRequestHeader *header, uint16_t type, c
 /*
  * 根据请求设定响应报文，自动获取时间。
  */
-CityResponseHeader *construct_response(CityResponseHeader *response, CityRequestHeader *request);
+CityResponseHeader *construct_response(CityResponseHeader *response, const CityRequestHeader *request);
 
 /*
  * 将请求报文从网络字节序转换成主机字节序
@@ -81,4 +135,9 @@ CityResponseHeader *response_ntoh(CityResponseHeader *header);
  */
 CityResponseHeader *response_hton(CityResponseHeader *header);
 
+/*
+ * 计算城市名的哈希值，最多处理 city_name 字段的长度
+ */
+uint32_t city_hash(const char *city_name);
+
 #endif // PROXY_H
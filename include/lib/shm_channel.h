@@ -0,0 +1,72 @@
+/**
+ * @file     shm_channel.h
+ * @author   whz
+ * @brief    同一主机上客户端与服务器之间的共享内存通道
+ */
+
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+#include <lib/proxy.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * @brief 每个方向的环形缓冲区槽位数，必须是 2 的幂
+ */
+#define SHM_RING_SLOT  64
+
+#define SHM_CHANNEL_MAGIC  0x57534d32  /* "WSM2" */
+
+/**
+ * @brief 单生产者单消费者环的索引
+ *
+ * 生产者与消费者各自写的字段分处不同缓存行，避免伪共享。
+ * waiting 为门铃：消费者睡眠前置位，生产者发现置位后用 futex 唤醒。
+ */
+typedef struct {
+    _Alignas(64) _Atomic uint32_t  head;     /**< 生产者写入的下一个位置 */
+    _Atomic uint32_t               waiting;  /**< 消费者是否在 head 上睡眠 */
+    _Alignas(64) _Atomic uint32_t  tail;     /**< 消费者读取的下一个位置 */
+} ShmRing;
+
+/**
+ * @brief 请求环的槽位
+ */
+typedef struct {
+    uint32_t           sequence;  /**< 客户端分配的序号，服务器原样写回响应 */
+    CityRequestHeader  request;
+} ShmRequestSlot;
+
+/**
+ * @brief 响应环的槽位
+ *
+ * 客户端等待超时后，迟到的响应仍会进入响应环，凭序号识别并丢弃。
+ */
+typedef struct {
+    uint32_t            sequence;  /**< 对应请求的序号 */
+    CityResponseHeader  response;
+} ShmResponseSlot;
+
+/**
+ * @brief 共享内存段布局，报文与 TCP 上完全相同，保持网络字节序
+ */
+typedef struct {
+    uint32_t         magic;
+    ShmRing          request_ring;
+    ShmRequestSlot   requests[SHM_RING_SLOT];
+    ShmRing          response_ring;
+    ShmResponseSlot  responses[SHM_RING_SLOT];
+} ShmChannel;
+
+/**
+ * 向环中写入一个元素，环满时等待，超时返回 -1
+ */
+int shm_ring_push(ShmRing *ring, void *slots, size_t size, const void *item, int timeout_ms);
+
+/**
+ * 从环中取出一个元素，先自旋再睡眠，超时返回 -1
+ */
+int shm_ring_pop(ShmRing *ring, void *slots, size_t size, void *item, int timeout_ms);
+
+#endif // SHM_CHANNEL_H
@@ -0,0 +1,33 @@
+/**
+ * @file     backend.h
+ * @author   whz
+ * @brief    中继的后端服务器集合接口
+ */
+
+#ifndef RELAY_BACKEND_H
+#define RELAY_BACKEND_H
+
+#include <lib/proxy.h>
+#include <stddef.h>
+
+/**
+ * 添加一个后端服务器，地址格式为 ip:port
+ */
+int backend_add(const char *address);
+
+/**
+ * 建立一致性哈希环、连接池，并启动健康检查线程
+ */
+void backend_start(void);
+
+/**
+ * 根据城市名选出负责的健康后端
+ */
+int backend_route(const char *city_name);
+
+/**
+ * 通过连接池向后端发送一个请求并等待其响应
+ */
+int backend_forward(int backend, const void *request, size_t size, CityResponseHeader *response);
+
+#endif // RELAY_BACKEND_H
@@ -0,0 +1,22 @@
+/**
+ * @file     busy_poll.h
+ * @author   whz
+ * @brief    忙轮询服务模式接口
+ */
+
+#ifndef BUSY_POLL_H
+#define BUSY_POLL_H
+
+#include <server/weather_service.h>
+
+/**
+ * 启动 n_poller 个轮询线程，空闲时最多自旋 budget_us 微秒再阻塞
+ */
+void busy_poll_init(unsigned n_poller, unsigned budget_us);
+
+/**
+ * 把新连接交给轮询线程服务
+ */
+void busy_poll_add(Connection *link);
+
+#endif // BUSY_POLL_H
@@ -0,0 +1,17 @@
+/**
+ * @file     city_catalog.h
+ * @author   whz
+ * @brief    按前缀查找城市名的目录接口
+ */
+
+#ifndef CITY_CATALOG_H
+#define CITY_CATALOG_H
+
+#include <lib/proxy.h>
+
+/**
+ * 查找以 prefix 开头的城市，按名字升序最多返回 max 个
+ */
+int city_catalog_prefix(const char *prefix, CityNameRecord *out, int max);
+
+#endif // CITY_CATALOG_H
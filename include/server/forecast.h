@@ -0,0 +1,45 @@
+/**
+ * @file     forecast.h
+ * @author   whz
+ * @brief    上游天气源接口与请求合并层
+ */
+
+#ifndef FORECAST_H
+#define FORECAST_H
+
+#include <lib/proxy.h>
+
+/**
+ * @brief 上游天气源
+ *
+ * fetch 在工作线程中同步调用，可以很慢。out 的每一项预先填为 weather_type >= NR_WEATHER，
+ * 表示该天没有数据；返回取得数据的天数，出错时返回 -1。
+ */
+typedef struct ForecastBackend {
+    const char *name;
+    int (*fetch)(struct ForecastBackend *backend, const char *city,
+                 uint8_t first_day, uint8_t n_day, WeatherStatus *out);
+    void *context;
+} ForecastBackend;
+
+/**
+ * 设置上游天气源，启动 max_inflight 个抓取线程
+ */
+void forecast_init(ForecastBackend *backend, unsigned max_inflight, unsigned ttl);
+
+/**
+ * 保证存储中城市连续若干天的数据可用于响应
+ */
+void forecast_ensure(const char *city, uint8_t first_day, uint8_t n_day);
+
+/**
+ * 按需发起抓取但不等待，需要等待抓取完成时返回 -1
+ */
+int forecast_prefetch(const char *city, uint8_t first_day, uint8_t n_day);
+
+/**
+ * 以文本文件模拟的上游天气源
+ */
+ForecastBackend *forecast_file_backend(const char *path, unsigned latency_ms);
+
+#endif // FORECAST_H
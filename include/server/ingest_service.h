@@ -0,0 +1,15 @@
+/**
+ * @file     ingest_service.h
+ * @author   whz
+ * @brief    录入套接字接口
+ */
+
+#ifndef INGEST_SERVICE_H
+#define INGEST_SERVICE_H
+
+/**
+ * 在 Unix 域套接字上接受数据源的连接，按对端身份授权录入
+ */
+void ingest_service_start(const char *path);
+
+#endif // INGEST_SERVICE_H
@@ -0,0 +1,22 @@
+/**
+ * @file     rate_limit.h
+ * @author   whz
+ * @brief    按客户端 IP 限制请求速率的接口
+ */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <inttypes.h>
+
+/**
+ * 设置限速参数，rate 为 0 时不限速
+ */
+void rate_limit_init(unsigned rate, unsigned burst);
+
+/**
+ * 为客户端消耗一个令牌，返回是否允许本次请求
+ */
+int rate_limit_acquire(uint32_t ip);
+
+#endif // RATE_LIMIT_H
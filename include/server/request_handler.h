@@ -0,0 +1,23 @@
+/**
+ * @file     request_handler.h
+ * @author   whz
+ * @brief    与传输方式无关的请求处理接口
+ */
+
+#ifndef REQUEST_HANDLER_H
+#define REQUEST_HANDLER_H
+
+#include <lib/proxy.h>
+#include <server/trace.h>
+
+/**
+ * 构造响应并处理与连接无关的请求，请求类型需要连接状态时返回 -1
+ */
+int handle_request(const CityRequestHeader *request, CityResponseHeader *response, TraceRecord *trace);
+
+/**
+ * 判断处理请求是否需要等待上游抓取，需要时顺带发起抓取
+ */
+int request_would_block(const CityRequestHeader *request);
+
+#endif // REQUEST_HANDLER_H
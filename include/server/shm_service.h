@@ -0,0 +1,15 @@
+/**
+ * @file     shm_service.h
+ * @author   whz
+ * @brief    同一主机客户端的共享内存服务接口
+ */
+
+#ifndef SHM_SERVICE_H
+#define SHM_SERVICE_H
+
+/**
+ * 在 Unix 域套接字上监听，为每个客户端建立共享内存通道
+ */
+void shm_service_start(const char *path);
+
+#endif // SHM_SERVICE_H
@@ -0,0 +1,25 @@
+/**
+ * @file     snapshot.h
+ * @author   whz
+ * @brief    天气存储的快照持久化接口
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/**
+ * 将存储写入快照文件
+ */
+int snapshot_save(const char *path);
+
+/**
+ * 将快照文件映射为存储
+ */
+int snapshot_load(const char *path);
+
+/**
+ * 启动后台快照线程
+ */
+void snapshot_start(const char *path, unsigned interval);
+
+#endif // SNAPSHOT_H
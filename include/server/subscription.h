@@ -0,0 +1,47 @@
+/**
+ * @file     subscription.h
+ * @author   whz
+ * @brief    城市天气订阅与推送接口
+ */
+
+#ifndef SUBSCRIPTION_H
+#define SUBSCRIPTION_H
+
+#include <server/weather_service.h>
+
+/**
+ * 初始化订阅表，启动推送线程
+ */
+void subscription_init(void);
+
+/**
+ * 为连接订阅城市
+ */
+int subscription_add(Connection *link, const char *city);
+
+/**
+ * 取消连接对城市的订阅
+ */
+void subscription_remove(Connection *link, const char *city);
+
+/**
+ * 取消连接的全部订阅，连接关闭前调用
+ */
+void subscription_drop(Connection *link);
+
+/**
+ * 标记城市数据发生变化
+ */
+void subscription_notify(const char *city);
+
+/**
+ * 唤醒推送线程，发送此前标记的全部变化
+ */
+void subscription_flush(void);
+
+/**
+ * 连接出现发送积压，由推送线程在对端可写时继续发送，调用者需持有发送锁
+ */
+void subscription_backlog(Connection *link);
+
+#endif // SUBSCRIPTION_H
@@ -0,0 +1,80 @@
+/**
+ * @file     trace.h
+ * @author   whz
+ * @brief    请求处理各阶段的采样追踪接口
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+#include <time.h>
+
+/**
+ * @brief 一次请求中打点的位置，相邻两点之间为一个阶段
+ */
+typedef enum {
+    TRACE_RECV_BEGIN,   /**< 开始接收，recv 阶段包含等待客户端的时间 */
+    TRACE_RECV_END,     /**< 收到请求 */
+    TRACE_DECODE,       /**< 字节序转换与校验完成 */
+    TRACE_CONSTRUCT,    /**< 限速判断与 construct_response 完成 */
+    TRACE_LOOKUP,       /**< 查询与业务处理完成 */
+    TRACE_SEND,         /**< 发送完成 */
+    NR_TRACE_STAMP
+} TraceStamp;
+
+/**
+ * @brief 一次被采样的请求
+ */
+typedef struct {
+    uint64_t  stamp[NR_TRACE_STAMP];  /**< 各点的时钟读数 */
+    int       connection;             /**< 连接编号 */
+    uint16_t  type;                   /**< 请求类型 */
+} TraceRecord;
+
+/**
+ * @brief 采样间隔，每 trace_interval 个请求采样一个，为 0 时关闭
+ */
+extern unsigned trace_interval;
+
+/**
+ * @brief 读取追踪时钟，x86 上为 TSC，其余平台为单调时钟的纳秒数
+ */
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief 在采样的请求上打点
+ */
+#define TRACE_STAMP(trace, point) \
+    do { if (trace) (trace)->stamp[point] = trace_clock(); } while (0)
+
+/**
+ * 设置采样间隔与输出文件，需在创建其它线程之前调用
+ */
+void trace_init(unsigned interval, const char *path);
+
+/**
+ * 决定当前线程的本次请求是否采样，采样时返回 record，否则返回 NULL
+ */
+TraceRecord *trace_sample(TraceRecord *record);
+
+/**
+ * 将采样完成的记录写入缓冲区
+ */
+void trace_commit(const TraceRecord *record);
+
+/**
+ * 将缓冲区中的记录导出为 Chrome trace-event JSON
+ */
+int trace_dump(const char *path);
+
+#endif // TRACE_H
@@ -7,20 +7,83 @@
 #ifndef WEATHER_SERVICE_H
 #define WEATHER_SERVICE_H
 
+#include <lib/proxy.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include <pthread.h>
+#include <stdatomic.h>
+
+/**
+ * @brief 每个连接最多订阅的城市数
+ */
+#define MAX_SUBSCRIPTION  32
 
 /**
  * @brief 描述连接状态
  */
-typedef struct {
+typedef struct Connection {
     int                 id;         /**< 连接编号 */
     pthread_t           tid;        /**< 服务线程 ID */
     int                 socket_fd;  /**< 连接套接字 */
     struct sockaddr_in  address;    /**< 客户端 IP 地址 */
     socklen_t           length;     /**< 客户端地址长度 */
+    int                 trusted;    /**< 来自录入套接字且通过身份校验，允许录入且不限速 */
+    atomic_int          refcount;   /**< 引用计数，归零时关闭套接字并释放 */
+    pthread_mutex_t     send_lock;  /**< 保护发送积压，串行化响应与推送的发送 */
+    char               *backlog;    /**< 对端来不及接收的字节，首次积压时分配 */
+    size_t              n_backlog;  /**< 积压的字节数，非零时由推送线程负责发出 */
+
+    pthread_mutex_t     sub_lock;                           /**< 保护订阅列表 */
+    char                subscriptions[MAX_SUBSCRIPTION][20]; /**< 订阅的城市，空串表示空位 */
+    atomic_uint         pending;    /**< 待推送的订阅位图，第 i 位对应 subscriptions[i] */
+    atomic_int          queued;     /**< 是否已在推送队列中 */
+    struct Connection  *next_dirty; /**< 推送队列链接 */
 } Connection;
 
+/**
+ * @brief 处理已解码请求的方式
+ */
+typedef enum {
+    RESPOND_BLOCKING,     /**< 服务线程独占连接，可以等待上游 */
+    RESPOND_NONBLOCKING,  /**< 轮询线程，需要等待上游的请求不处理而返回 1 */
+    RESPOND_DEFERRED,     /**< 工作线程接手被推迟的请求，限速已在推迟前判断过 */
+} RespondMode;
+
+/**
+ * 创建连接对象，引用计数为 1
+ */
+Connection *connection_new(void);
+
+/**
+ * 增加连接的引用计数
+ */
+void connection_get(Connection *link);
+
+/**
+ * 减少连接的引用计数，归零时释放
+ */
+void connection_put(Connection *link);
+
+/**
+ * 以不阻塞的方式发送一个完整报文，发不完的部分进入积压，积压超限时返回 -1
+ */
+int connection_send(Connection *link, const struct iovec *iov, int n_iov);
+
+/**
+ * 处理连接上的一个请求，连接结束时返回 -1
+ */
+int weather_service_serve(Connection *link);
+
+/**
+ * 处理一个已解码的请求并发送响应，需要等待上游而不允许阻塞时返回 1
+ */
+int weather_service_respond(Connection *link, const CityRequestHeader *request, RespondMode mode);
+
+/**
+ * 结束连接上的服务，释放服务方持有的引用
+ */
+void weather_service_close(Connection *link);
+
 /**
  * 服务入口
  */
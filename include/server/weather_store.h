@@ -0,0 +1,84 @@
+/**
+ * @file     weather_store.h
+ * @author   whz
+ * @brief    内存天气数据存储接口
+ */
+
+#ifndef WEATHER_STORE_H
+#define WEATHER_STORE_H
+
+#include <lib/proxy.h>
+#include <stddef.h>
+
+/**
+ * @brief 每个城市保存的历史天数，即日期距离的最大值
+ */
+#define NR_HISTORY_DAY  UINT8_MAX
+
+/**
+ * @brief 存储的内存布局，供快照直接读写
+ */
+typedef struct {
+    void     *index;       /**< 全部分片的表项，页对齐 */
+    size_t    index_size;  /**< 表项的字节数 */
+    void     *rows;        /**< 行数组，页对齐 */
+    size_t    row_size;    /**< 每行的字节数 */
+    uint32_t  max_row;     /**< 行数上限 */
+} WeatherStoreLayout;
+
+/**
+ * 初始化存储，预留地址空间
+ */
+void weather_store_init(void);
+
+/**
+ * 为固定城市集合生成初始数据
+ */
+void weather_store_seed(void);
+
+/**
+ * 获取存储的内存布局
+ */
+void weather_store_layout(WeatherStoreLayout *layout);
+
+/**
+ * 在全部分片锁下复制表项，返回已分配的行数
+ */
+uint32_t weather_store_copy_index(void *index);
+
+/**
+ * 在顺序锁保护下复制一行
+ */
+void weather_store_copy_row(uint32_t id, void *row);
+
+/**
+ * 接管已映射到布局地址上的数据
+ */
+void weather_store_adopt(uint32_t count);
+
+/**
+ * 获取已分配的行数
+ */
+uint32_t weather_store_count(void);
+
+/**
+ * 读取一行的城市名，该行尚未发布时返回 -1
+ */
+int weather_store_row_name(uint32_t id, char name[20]);
+
+/**
+ * 判断城市是否存在，不加锁
+ */
+int weather_store_contains(const char *city);
+
+/**
+ * 读取城市连续若干天的天气，不加锁
+ */
+int weather_store_lookup(const char *city, uint8_t first_day, uint8_t n_day, WeatherStatus *out);
+
+/**
+ * 更新城市某天的天气，城市不存在时自动创建
+ */
+int weather_store_update(const char *city, uint8_t date, uint8_t weather_type, int8_t temperature);
+
+#endif // WEATHER_STORE_H
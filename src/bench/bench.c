@@ -0,0 +1,183 @@
+/**
+ * @file     bench.c
+ * @author   whz
+ * @brief    进程内的请求处理基准测试
+ *
+ * 不经过任何套接字，多个线程各自按固定的合成请求流直接调用 handle_request()，
+ * 测得的是请求处理本身的开销，与内核网络栈无关。
+ */
+
+#define _GNU_SOURCE
+#include "server/request_handler.h"
+#include "server/weather_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/**
+ * @brief 每个线程循环使用的合成请求数
+ */
+#define NR_SYNTHETIC  4096
+
+/**
+ * @brief 合成请求中查询不存在城市的比例，单位为百分之一
+ */
+#define MISS_PERCENT  10
+
+/**
+ * @brief 测试线程的参数与结果
+ */
+typedef struct {
+    int        id;
+    unsigned   n_city;     /**< 合成城市数 */
+    uint64_t   n_request;  /**< 完成的请求数 */
+    pthread_t  tid;
+} Worker;
+
+static atomic_int running;
+
+/**
+ * @brief 生成第 i 个合成城市的名字
+ */
+static void city_name(char name[20], unsigned i)
+{
+    snprintf(name, 20, "city%u", i);
+}
+
+/**
+ * @brief 生成合成请求流，类型与城市按固定种子随机分布
+ * @param requests 输出数组，NR_SYNTHETIC 个元素
+ * @param n_city   合成城市数
+ * @param seed     随机种子
+ */
+static void synthesize(CityRequestHeader *requests, unsigned n_city, unsigned seed)
+{
+    static const uint16_t types[] = { REQUEST_CITY, REQUEST_SINGLE_DAY, REQUEST_MULTIPLE_DAY };
+
+    for (int i = 0; i < NR_SYNTHETIC; i++) {
+        CityRequestHeader *request = &requests[i];
+        memset(request, 0, sizeof(*request));
+        request->type = types[rand_r(&seed) % (sizeof(types) / sizeof(types[0]))];
+        if (rand_r(&seed) % 100 < MISS_PERCENT) {
+            strcpy(request->city_name, "nowhere");
+        }
+        else {
+            city_name(request->city_name, rand_r(&seed) % n_city);
+        }
+        request->date = request->type == REQUEST_MULTIPLE_DAY ? 3 : (uint8_t)(1 + rand_r(&seed) % 7);
+    }
+}
+
+/**
+ * @brief 测试线程，绑定到一个 CPU 上反复处理合成请求
+ */
+static void *worker_main_loop(void *arg)
+{
+    Worker *worker = arg;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    CityRequestHeader *requests = malloc(NR_SYNTHETIC * sizeof(CityRequestHeader));
+    synthesize(requests, worker->n_city, (unsigned)worker->id + 1);
+
+    CityResponseHeader response;
+    uint64_t n_request = 0;
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        for (int i = 0; i < NR_SYNTHETIC; i++) {
+            handle_request(&requests[i], &response, NULL);
+        }
+        n_request += NR_SYNTHETIC;
+    }
+
+    worker->n_request = n_request;
+    free(requests);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned n_thread = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned duration = 5, n_city = 10000;
+
+    int option;
+    while ((option = getopt(argc, argv, "t:d:c:")) != -1) {
+        switch (option) {
+            case 't':
+                n_thread = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                duration = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                n_city = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                n_thread = 0;
+                break;
+        }
+    }
+
+    if (optind != argc || n_thread == 0 || n_city == 0) {
+        int indent;
+        fprintf(stderr, "Usage: %n%s [options]\n", &indent, argv[0]);
+        fprintf(stderr, "%*s-t <threads>  # worker threads, default one per CPU\n", indent, "");
+        fprintf(stderr, "%*s-d <seconds>  # measuring duration, default 5\n", indent, "");
+        fprintf(stderr, "%*s-c <cities>   # synthetic cities in the store, default 10000\n", indent, "");
+        exit(-1);
+    }
+
+    // 每个城市填入 5 天的数据，查询第 6、7 天的单天请求得到 RESPONSE_NO_DAY
+    weather_store_init();
+    for (unsigned i = 0; i < n_city; i++) {
+        char name[20];
+        city_name(name, i);
+        for (uint8_t day = 1; day <= 5; day++) {
+            if (weather_store_update(name, day, (uint8_t)(i % NR_WEATHER), (int8_t)(i % 40)) < 0) {
+                fprintf(stderr, "ERROR: store is full after %u cities.\n", i);
+                exit(-1);
+            }
+        }
+    }
+
+    Worker *workers = calloc(n_thread, sizeof(Worker));
+    atomic_store(&running, 1);
+    for (unsigned i = 0; i < n_thread; i++) {
+        workers[i].id = (int)i;
+        workers[i].n_city = n_city;
+        pthread_create(&workers[i].tid, NULL, worker_main_loop, &workers[i]);
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    sleep(duration);
+    atomic_store(&running, 0);
+
+    uint64_t total = 0;
+    for (unsigned i = 0; i < n_thread; i++) {
+        pthread_join(workers[i].tid, NULL);
+        total += workers[i].n_request;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (double)(end.tv_sec - begin.tv_sec) + (double)(end.tv_nsec - begin.tv_nsec) / 1e9;
+    long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned n_core = n_thread < n_cpu ? n_thread : (unsigned)n_cpu;
+
+    for (unsigned i = 0; i < n_thread; i++) {
+        printf("thread %u: %.0f requests/s\n", i, (double)workers[i].n_request / seconds);
+    }
+    printf("%u threads on %u cores, %u cities: %.0f requests/s, %.0f requests/s per core, %.0f ns/request\n",
+           n_thread, n_core, n_city, (double)total / seconds, (double)total / seconds / n_core,
+           seconds * 1e9 * n_core / (double)total);
+
+    free(workers);
+    return 0;
+}
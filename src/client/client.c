@@ -21,14 +21,35 @@
  */
 int main(int argc, char *argv[])
 {
-    if ((argc != 1 && argc != 3) || (argc > 1 && !strcmp(argv[1], "help"))) {
+    int multi = argc > 2 && !strcmp(argv[1], "multi");
+    if ((argc != 1 && argc != 3 && !multi) || (argc > 1 && !strcmp(argv[1], "help"))) {
         int indent;
         printf("Usage: %n%s                            # connects to official server\n", &indent, argv[0]);
         printf(      "%*s%s <server-ip> <server-port>  # connects to custom server\n", indent, "", argv[0]);
+        printf(      "%*s%s shm <socket-path>          # connects to same-host server over shared memory\n", indent, "", argv[0]);
+        printf(      "%*s%s multi <ip:port> ...        # uses the fastest of several servers, hedging slow requests\n", indent, "", argv[0]);
         printf(      "%*s%s help                       # show this message\n", indent, "", argv[0]);
         return 0;
     }
 
+    if (multi) {
+        Transport *transport = multi_transport(argc - 2, argv + 2);
+        if (transport == NULL) {
+            exit(-1);
+        }
+        monitor_main_loop(transport);
+        return 0;
+    }
+
+    if (argc == 3 && !strcmp(argv[1], "shm")) {
+        Transport *transport = shm_transport(argv[2]);
+        if (transport == NULL) {
+            exit(-1);
+        }
+        monitor_main_loop(transport);
+        return 0;
+    }
+
     struct sockaddr_in client_address = {};
     client_address.sin_family = AF_INET;
     client_address.sin_addr.s_addr =
@@ -48,5 +69,5 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    monitor_main_loop(client_socket_fd);
+    monitor_main_loop(tcp_transport(client_socket_fd));
 }
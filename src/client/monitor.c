@@ -6,7 +6,7 @@
 
 #include "client/monitor.h"
 #include "client/config.h"
-#include <sys/socket.h>
+#include "client/transport.h"
 #include <stdlib.h>
 #include <string.h>
 #include <lib/proxy.h>
@@ -25,14 +25,14 @@ typedef enum {
  */
 typedef struct {
     MonitorState state;
-    int client_socket;
+    Transport *transport;
     char city[64];
     char command[1024];
 } Monitor;
 
 /**
  * @brief 发送请求辅助函数
- * @param socket_fd 客户端的套接字
+ * @param transport 客户端的传输方式
  * @param type      请求类型，见 proxy.h 以 REQUEST_ 开头的宏定义
  * @param city_name 城市名称，只接受前 19 个有效字节
  * @param date      在单天请求中，表示日期下标，在多天请求中，表示天数
@@ -42,19 +42,12 @@ typedef struct {
  * 注意返回的报文也转换过字节序。
  */
 static CityResponseHeader *
-request_helper(int socket_fd, uint16_t type, const char *city_name, uint8_t date, CityResponseHeader *response)
+request_helper(Transport *transport, uint16_t type, const char *city_name, uint8_t date, CityResponseHeader *response)
 {
     CityRequestHeader request;
     construct_request(&request, type, city_name, date);
 
-    if (send(socket_fd, &request, sizeof(request), 0) == -1) {
-        perror(MSG_SEND_FAILURE);
-        return NULL;
-    }
-
-    ssize_t n_read = recv(socket_fd, response, sizeof(*response), 0);
-
-    if (n_read != sizeof(*response)) {
+    if (transport->roundtrip(transport, &request, response)) {
         perror(MSG_SEND_FAILURE);
         return NULL;
     }
@@ -64,15 +57,15 @@ request_helper(int socket_fd, uint16_t type, const char *city_name, uint8_t date
 
 /**
  * @brief 查询城市是否存在
- * @param socket_fd 客户端的套接字
+ * @param transport 客户端的传输方式
  * @param city_name 城市名
  * @return 成功时返回 0, 失败时返回 -1.
  */
-static int query_city_exists(int socket_fd, const char *city_name)
+static int query_city_exists(Transport *transport, const char *city_name)
 {
     CityResponseHeader response;
 
-    if (request_helper(socket_fd, REQUEST_CITY, city_name, 1, &response) == NULL) {
+    if (request_helper(transport, REQUEST_CITY, city_name, 1, &response) == NULL) {
         return -1;
     }
 
@@ -98,7 +91,7 @@ static void city_query_handler(Monitor *monitor_ptr)
     else if (!strcmp(monitor_ptr->command, CMD_EXIT)) {
         monitor_ptr->state = EXIT;
     }
-    else if (query_city_exists(monitor_ptr->client_socket, monitor_ptr->command) == 0) {
+    else if (query_city_exists(monitor_ptr->transport, monitor_ptr->command) == 0) {
         system("clear");
         puts(CITY_HEADER);
         strncpy(monitor_ptr->city, monitor_ptr->command, sizeof(monitor_ptr->city));
@@ -162,13 +155,13 @@ static void weather_query_handler(Monitor *monitor_ptr)
         monitor_ptr->state = EXIT;
     }
     else if (!strcmp(monitor_ptr->command, CMD_TODAY)) {
-        request_helper(monitor_ptr->client_socket, REQUEST_SINGLE_DAY, monitor_ptr->city, 1, &response);
+        request_helper(monitor_ptr->transport, REQUEST_SINGLE_DAY, monitor_ptr->city, 1, &response);
         puts_city_info(&response);
         puts_weather_info(&response, 0, 1);
         monitor_ptr->state = QUERY_WEATHER;
     }
     else if (!strcmp(monitor_ptr->command, CMD_THREE_DAY)) {
-        request_helper(monitor_ptr->client_socket, REQUEST_MULTIPLE_DAY, monitor_ptr->city, 3, &response);
+        request_helper(monitor_ptr->transport, REQUEST_MULTIPLE_DAY, monitor_ptr->city, 3, &response);
         puts_city_info(&response);
         for (int i = 0; i < response.n_status; i++) {
             puts_weather_info(&response, i + 1, 0);
@@ -188,7 +181,7 @@ static void weather_query_handler(Monitor *monitor_ptr)
             printf("%s", REQUEST_CUSTOM_DAY);
         };
 
-        request_helper(monitor_ptr->client_socket, REQUEST_SINGLE_DAY, monitor_ptr->city, (uint8_t)no, &response);
+        request_helper(monitor_ptr->transport, REQUEST_SINGLE_DAY, monitor_ptr->city, (uint8_t)no, &response);
 
         if (response.type == RESPONSE_NO_DAY) {
             char *msg = NO_WEATHER(response.city_name);
@@ -210,13 +203,13 @@ static void weather_query_handler(Monitor *monitor_ptr)
 
 /**
  * @brief 控制台状态机
- * @param socket_fd 客户端套接字
+ * @param transport 客户端的传输方式
  */
-void monitor_main_loop(int socket_fd)
+void monitor_main_loop(Transport *transport)
 {
     Monitor monitor = {
-        .state         = QUERY_CITY,
-        .client_socket = socket_fd,
+        .state     = QUERY_CITY,
+        .transport = transport,
     };
 
     system("clear");
@@ -0,0 +1,332 @@
+/**
+ * @file     multi_transport.c
+ * @author   whz
+ * @brief    连接多个服务器、按延迟选择并对冲请求的传输方式
+ *
+ * 对每个服务器维护延迟的指数滑动平均与最近若干次的样本，每个请求发往平均延迟最低的服务器。
+ * 超过该服务器 p95 延迟仍未收到响应时，向次优的服务器发送一份相同的请求，先到的响应生效。
+ * 落后的响应留在套接字中，下次请求前读出丢弃，同时计入该服务器的延迟样本；
+ * 届时仍未返回的连接会挡住后续请求，直接重连。
+ * 连接出错的服务器标记为宕机，一段时间后再尝试重连。
+ *
+ * 客户端不链接线程库，全部在调用线程上用 poll 完成。
+ */
+
+#include "client/transport.h"
+#include "client/config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_SERVER           16
+#define NR_SAMPLE            32        /**< 计算 p95 的样本窗口 */
+#define MIN_SAMPLE           8         /**< 样本不足时使用默认对冲延迟 */
+#define DEFAULT_HEDGE_US     20000
+#define MIN_HEDGE_US         200
+#define RESPONSE_TIMEOUT_US  5000000   /**< 超过该时间没有响应视为宕机 */
+#define RETRY_US             1000000   /**< 宕机后重连的间隔 */
+#define CONNECT_TIMEOUT_MS   500
+
+/**
+ * @brief 一个服务器的连接状态与延迟统计
+ */
+typedef struct {
+    struct sockaddr_in  address;
+    int                 socket_fd;     /**< 宕机时为 -1 */
+    int64_t             retry_at;      /**< 宕机后下次重连的时刻 */
+    int                 outstanding;   /**< 是否有尚未读取的响应 */
+    int64_t             sent_at;       /**< 未读取的请求的发送时刻 */
+    int64_t             ewma_us;       /**< 延迟的滑动平均，0 表示还没有样本 */
+    int64_t             samples[NR_SAMPLE];
+    unsigned            n_sample;
+} Server;
+
+typedef struct {
+    Server  servers[MAX_SERVER];
+    int     n_server;
+} MultiContext;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief 标记服务器宕机，丢弃连接上未读取的响应
+ */
+static void server_down(Server *server)
+{
+    if (server->socket_fd >= 0) {
+        close(server->socket_fd);
+    }
+    server->socket_fd = -1;
+    server->outstanding = 0;
+    server->retry_at = now_us() + RETRY_US;
+}
+
+/**
+ * @brief 连接服务器，连接超时不阻塞用户太久
+ * @return 成功时返回 0，失败时返回 -1
+ */
+static int server_connect(Server *server)
+{
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        server_down(server);
+        return -1;
+    }
+    server->socket_fd = socket_fd;
+
+    int flags = fcntl(socket_fd, F_GETFL);
+    fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(socket_fd, (struct sockaddr *)&server->address, sizeof(server->address))) {
+        struct pollfd fd = { .fd = socket_fd, .events = POLLOUT };
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (poll(&fd, 1, CONNECT_TIMEOUT_MS) != 1 ||
+            getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) || error) {
+            server_down(server);
+            return -1;
+        }
+    }
+    fcntl(socket_fd, F_SETFL, flags);
+
+    int nodelay = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return 0;
+}
+
+/**
+ * @brief 记录一次延迟样本
+ */
+static void server_record(Server *server, int64_t latency)
+{
+    server->samples[server->n_sample++ % NR_SAMPLE] = latency;
+    server->ewma_us = server->ewma_us ? server->ewma_us + (latency - server->ewma_us) / 8 : latency;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief 计算对冲延迟，即最近样本的 p95
+ */
+static int64_t hedge_delay(const Server *server)
+{
+    unsigned n = server->n_sample < NR_SAMPLE ? server->n_sample : NR_SAMPLE;
+    if (n < MIN_SAMPLE) {
+        return DEFAULT_HEDGE_US;
+    }
+
+    int64_t sorted[NR_SAMPLE];
+    memcpy(sorted, server->samples, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), compare_latency);
+    int64_t p95 = sorted[(n * 95 - 1) / 100];
+    return p95 > MIN_HEDGE_US ? p95 : MIN_HEDGE_US;
+}
+
+/**
+ * @brief 读取服务器上未读取的响应
+ * @return 成功时返回 0，连接出错时标记宕机并返回 -1
+ */
+static int server_receive(Server *server, CityResponseHeader *response)
+{
+    if (recv(server->socket_fd, response, sizeof(*response), MSG_WAITALL) != sizeof(*response)) {
+        server_down(server);
+        return -1;
+    }
+    server->outstanding = 0;
+    server_record(server, now_us() - server->sent_at);
+    return 0;
+}
+
+/**
+ * @brief 读出已到达的落后响应
+ *
+ * 同一连接上的响应按序返回，落后的请求会挡住之后的所有请求。
+ * 超过 p95 仍未返回的连接直接放弃并重连，已等待的时间作为延迟的下限计入样本，
+ * 重连失败的服务器标记为宕机。
+ */
+static void drain(MultiContext *context)
+{
+    for (int i = 0; i < context->n_server; i++) {
+        Server *server = &context->servers[i];
+        if (!server->outstanding) {
+            continue;
+        }
+
+        CityResponseHeader stale;
+        struct pollfd fd = { .fd = server->socket_fd, .events = POLLIN };
+        if (poll(&fd, 1, 0) == 1) {
+            server_receive(server, &stale);
+            continue;
+        }
+
+        int64_t waited = now_us() - server->sent_at;
+        if (waited > hedge_delay(server)) {
+            server_record(server, waited);
+            close(server->socket_fd);
+            server->socket_fd = -1;
+            server->outstanding = 0;
+            server_connect(server);
+        }
+    }
+}
+
+/**
+ * @brief 选出平均延迟最低的空闲服务器并发送请求
+ * @param context 传输状态
+ * @param request 网络字节序的请求
+ * @param exclude 不参与选择的服务器，可以为 NULL
+ * @return 发送成功的服务器，没有可用服务器时返回 NULL
+ *
+ * 还没有样本的服务器平均延迟视为 0，会被优先尝试。到了重连时刻的宕机服务器在此重连。
+ */
+static Server *dispatch(MultiContext *context, const CityRequestHeader *request, const Server *exclude)
+{
+    for (;;) {
+        Server *best = NULL;
+        for (int i = 0; i < context->n_server; i++) {
+            Server *server = &context->servers[i];
+            if (server == exclude || server->outstanding) {
+                continue;
+            }
+            if (server->socket_fd < 0 && (now_us() < server->retry_at || server_connect(server))) {
+                continue;
+            }
+            if (best == NULL || server->ewma_us < best->ewma_us) {
+                best = server;
+            }
+        }
+
+        if (best == NULL) {
+            return NULL;
+        }
+
+        if (send(best->socket_fd, request, sizeof(*request), MSG_NOSIGNAL) == sizeof(*request)) {
+            best->outstanding = 1;
+            best->sent_at = now_us();
+            return best;
+        }
+        server_down(best);
+    }
+}
+
+/**
+ * @brief 发送请求，必要时对冲，返回最先到达的响应
+ */
+static int multi_roundtrip(Transport *transport, const CityRequestHeader *request, CityResponseHeader *response)
+{
+    MultiContext *context = transport->context;
+
+    drain(context);
+
+    Server *inflight[2] = { dispatch(context, request, NULL), NULL };
+    if (inflight[0] == NULL) {
+        return -1;
+    }
+
+    int64_t hedge_at = inflight[0]->sent_at + hedge_delay(inflight[0]);
+    int64_t deadline = inflight[0]->sent_at + RESPONSE_TIMEOUT_US;
+
+    for (;;) {
+        struct pollfd fds[2];
+        Server *polled[2];
+        int n_fd = 0;
+        for (int i = 0; i < 2; i++) {
+            if (inflight[i] && inflight[i]->outstanding) {
+                fds[n_fd] = (struct pollfd){ .fd = inflight[i]->socket_fd, .events = POLLIN };
+                polled[n_fd++] = inflight[i];
+            }
+        }
+
+        int64_t now = now_us();
+        if (inflight[1] == NULL && (now >= hedge_at || n_fd == 0)) {
+            // 超过 p95 或首选服务器已断开，向次优服务器对冲
+            inflight[1] = dispatch(context, request, inflight[0]);
+            hedge_at = deadline;
+            if (inflight[1]) {
+                fds[n_fd] = (struct pollfd){ .fd = inflight[1]->socket_fd, .events = POLLIN };
+                polled[n_fd++] = inflight[1];
+            }
+        }
+
+        if (n_fd == 0) {
+            return -1;
+        }
+
+        int64_t wait_until = inflight[1] == NULL ? hedge_at : deadline;
+        int timeout = wait_until > now ? (int)((wait_until - now + 999) / 1000) : 0;
+        if (poll(fds, (nfds_t)n_fd, timeout) == 0) {
+            if (now_us() >= deadline) {
+                for (int i = 0; i < n_fd; i++) {
+                    server_down(polled[i]);
+                }
+                return -1;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n_fd; i++) {
+            if (fds[i].revents && server_receive(polled[i], response) == 0) {
+                return 0;
+            }
+        }
+    }
+}
+
+/**
+ * @brief 创建连接多个服务器的传输
+ * @param n_address 服务器个数
+ * @param addresses 形如 ip:port 的服务器地址
+ * @return 传输对象，地址格式错误或没有服务器可以连接时返回 NULL
+ */
+Transport *multi_transport(int n_address, char *addresses[])
+{
+    if (n_address <= 0 || n_address > MAX_SERVER) {
+        fprintf(stderr, "Expect 1 to %d servers\n", MAX_SERVER);
+        return NULL;
+    }
+
+    MultiContext *context = calloc(1, sizeof(MultiContext));
+    int n_up = 0;
+
+    for (int i = 0; i < n_address; i++) {
+        char ip[16];
+        unsigned port;
+        Server *server = &context->servers[i];
+        if (sscanf(addresses[i], "%15[^:]:%u", ip, &port) != 2 || port > UINT16_MAX ||
+            inet_pton(AF_INET, ip, &server->address.sin_addr) != 1) {
+            fprintf(stderr, "Invalid server address %s\n", addresses[i]);
+            free(context);
+            return NULL;
+        }
+        server->address.sin_family = AF_INET;
+        server->address.sin_port = htons((uint16_t)port);
+        n_up += server_connect(server) == 0;
+    }
+    context->n_server = n_address;
+
+    if (n_up == 0) {
+        fprintf(stderr, "%s\n", MSG_CONNECT_FAILURE);
+        free(context);
+        return NULL;
+    }
+
+    Transport *transport = malloc(sizeof(Transport));
+    transport->roundtrip = multi_roundtrip;
+    transport->context = context;
+    return transport;
+}
@@ -0,0 +1,174 @@
+/**
+ * @file     transport.c
+ * @author   whz
+ * @brief    客户端传输方式的实现
+ */
+
+#include "client/transport.h"
+#include "client/config.h"
+#include <lib/shm_channel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * @brief 共享内存通道等待响应的超时
+ */
+#define SHM_TIMEOUT_MS  5000
+
+/**
+ * @brief 共享内存传输的状态
+ */
+typedef struct {
+    int          socket_fd;  /**< Unix 域连接，保持打开以便服务器发现客户端退出 */
+    ShmChannel  *channel;    /**< 映射的共享内存通道 */
+    uint32_t     sequence;   /**< 上一个请求的序号 */
+} ShmContext;
+
+/**
+ * @brief 经由 TCP 套接字完成一次请求
+ */
+static int tcp_roundtrip(Transport *transport, const CityRequestHeader *request, CityResponseHeader *response)
+{
+    int socket_fd = (int)(intptr_t)transport->context;
+
+    if (send(socket_fd, request, sizeof(*request), 0) == -1) {
+        return -1;
+    }
+
+    ssize_t n_read = recv(socket_fd, response, sizeof(*response), MSG_WAITALL);
+    return n_read == sizeof(*response) ? 0 : -1;
+}
+
+/**
+ * @brief 创建 TCP 传输
+ * @param socket_fd 已连接的套接字
+ * @return 传输对象，进程结束前一直有效
+ */
+Transport *tcp_transport(int socket_fd)
+{
+    Transport *transport = malloc(sizeof(Transport));
+    transport->roundtrip = tcp_roundtrip;
+    transport->context = (void *)(intptr_t)socket_fd;
+    return transport;
+}
+
+/**
+ * @brief 当前时间，单位为毫秒
+ */
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief 经由共享内存完成一次请求
+ *
+ * 控制台同一时刻只有一个请求在途，两个环各只有一个生产者与一个消费者。
+ * 之前超时的请求的响应可能随后才到，序号不符的响应直接丢弃。
+ */
+static int shm_roundtrip(Transport *transport, const CityRequestHeader *request, CityResponseHeader *response)
+{
+    ShmContext *context = transport->context;
+    ShmChannel *channel = context->channel;
+
+    ShmRequestSlot slot = { .sequence = ++context->sequence, .request = *request };
+    int64_t deadline = now_ms() + SHM_TIMEOUT_MS;
+    if (shm_ring_push(&channel->request_ring, channel->requests, sizeof(slot), &slot, SHM_TIMEOUT_MS)) {
+        return -1;
+    }
+
+    for (;;) {
+        int64_t timeout = deadline - now_ms();
+        ShmResponseSlot reply;
+        if (timeout < 0 ||
+            shm_ring_pop(&channel->response_ring, channel->responses, sizeof(reply), &reply, (int)timeout)) {
+            return -1;
+        }
+        if (reply.sequence == slot.sequence) {
+            *response = reply.response;
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief 从 Unix 域连接上接收服务器发来的共享内存描述符
+ * @return 描述符，失败时返回 -1
+ */
+static int receive_fd(int socket_fd)
+{
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr message = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = sizeof(control)
+    };
+
+    if (recvmsg(socket_fd, &message, 0) != 1) {
+        return -1;
+    }
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+
+    int memory_fd;
+    memcpy(&memory_fd, CMSG_DATA(header), sizeof(int));
+    return memory_fd;
+}
+
+/**
+ * @brief 创建共享内存传输
+ * @param path 服务器的 Unix 域套接字路径
+ * @return 传输对象，失败时返回 NULL
+ */
+Transport *shm_transport(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        perror(MSG_SOCKET_FAILURE);
+        return NULL;
+    }
+
+    if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address))) {
+        perror(MSG_CONNECT_FAILURE);
+        close(socket_fd);
+        return NULL;
+    }
+
+    int memory_fd = receive_fd(socket_fd);
+    ShmChannel *channel = MAP_FAILED;
+    if (memory_fd >= 0) {
+        channel = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+        close(memory_fd);
+    }
+    if (channel == MAP_FAILED || channel->magic != SHM_CHANNEL_MAGIC) {
+        fprintf(stderr, "Cannot map shared memory channel from %s\n", path);
+        close(socket_fd);
+        return NULL;
+    }
+
+    ShmContext *context = malloc(sizeof(ShmContext));
+    context->socket_fd = socket_fd;
+    context->channel = channel;
+    context->sequence = 0;
+
+    Transport *transport = malloc(sizeof(Transport));
+    transport->roundtrip = shm_roundtrip;
+    transport->context = context;
+    return transport;
+}
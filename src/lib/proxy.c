@@ -48,7 +48,7 @@ construct_request(CityRequestHeader *header, uint16_t type, const char *city_nam
  * 类型可以配合初始化在构造之前设定。
  */
 CityResponseHeader *
-construct_response(CityResponseHeader *response, CityRequestHeader *request)
+construct_response(CityResponseHeader *response, const CityRequestHeader *request)
 {
     strncpy(response->city_name, request->city_name, sizeof(response->city_name) - 1);
     response->n_status = request->date;
@@ -101,3 +101,19 @@ response_hton(CityResponseHeader *header)
     header->year = ntohs(header->year);
     return header;
 }
+
+/**
+ * @brief 计算城市名的 FNV-1a 哈希值
+ * @param city_name 城市名，到终结符或 city_name 字段长度为止
+ * @return 哈希值
+ */
+uint32_t
+city_hash(const char *city_name)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(((CityRequestHeader *)0)->city_name) && city_name[i]; i++) {
+        h ^= (uint8_t)city_name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
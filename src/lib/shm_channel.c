@@ -0,0 +1,116 @@
+/**
+ * @file     shm_channel.c
+ * @author   whz
+ * @brief    共享内存通道的环形缓冲区操作
+ *
+ * 每个方向一个单生产者单消费者环。消费者取不到数据时先自旋一小段时间，
+ * 往返延迟因此可以低到几百纳秒；仍然没有数据才在 head 上用 futex 睡眠，
+ * 生产者只在消费者声明睡眠时才发起系统调用唤醒。
+ */
+
+#include <lib/shm_channel.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * @brief 消费者睡眠前的自旋次数
+ */
+#define SPIN_COUNT  20000
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+/**
+ * @brief 当前时间，单位为毫秒
+ */
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief 向环中写入一个元素
+ * @param ring       环的索引
+ * @param slots      槽位数组
+ * @param size       每个元素的字节数
+ * @param item       待写入的元素
+ * @param timeout_ms 环满时等待的最长时间，为负数时一直等待
+ * @return 成功时返回 0，超时返回 -1
+ *
+ * 环满时让出 CPU 等待消费者，消费者不再取出时不会无限等待下去。
+ */
+int shm_ring_push(ShmRing *ring, void *slots, size_t size, const void *item, int timeout_ms)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    int64_t deadline = timeout_ms < 0 ? 0 : now_ms() + timeout_ms;
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= SHM_RING_SLOT) {
+        if (timeout_ms >= 0 && now_ms() >= deadline) {
+            return -1;
+        }
+        sched_yield();
+    }
+
+    memcpy((char *)slots + (head % SHM_RING_SLOT) * size, item, size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_seq_cst);
+
+    // 与消费者先置 waiting 再检查 head 的顺序配对，不会丢失唤醒
+    if (atomic_load_explicit(&ring->waiting, memory_order_seq_cst)) {
+        atomic_store_explicit(&ring->waiting, 0, memory_order_relaxed);
+        syscall(SYS_futex, &ring->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+/**
+ * @brief 从环中取出一个元素
+ * @param ring       环的索引
+ * @param slots      槽位数组
+ * @param size       每个元素的字节数
+ * @param item       取出的元素
+ * @param timeout_ms 睡眠等待的最长时间，为负数时一直等待
+ * @return 成功时返回 0，超时返回 -1
+ */
+int shm_ring_pop(ShmRing *ring, void *slots, size_t size, void *item, int timeout_ms)
+{
+    // 单核上自旋只会拖延生产者，直接睡眠
+    static int spin_count = -1;
+    if (spin_count < 0) {
+        spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_COUNT : 0;
+    }
+
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (int i = 0; atomic_load_explicit(&ring->head, memory_order_acquire) == tail; i++) {
+        if (i < spin_count) {
+            cpu_relax();
+            continue;
+        }
+
+        atomic_store_explicit(&ring->waiting, 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&ring->head, memory_order_seq_cst) != tail) {
+            continue;
+        }
+
+        struct timespec timeout = {
+            .tv_sec  = timeout_ms / 1000,
+            .tv_nsec = timeout_ms % 1000 * 1000000L
+        };
+        syscall(SYS_futex, &ring->head, FUTEX_WAIT, tail, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+        if (timeout_ms >= 0 && atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+            return -1;
+        }
+    }
+
+    memcpy(item, (char *)slots + (tail % SHM_RING_SLOT) * size, size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
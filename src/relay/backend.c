@@ -0,0 +1,455 @@
+/**
+ * @file     backend.c
+ * @author   whz
+ * @brief    后端服务器集合：一致性哈希、流水线连接池与健康检查
+ *
+ * 每个后端在哈希环上占 #NR_VNODE 个虚拟节点，按城市名哈希选择后端，
+ * 使同一城市总是落到同一台服务器上，后端宕机时顺延到环上下一台健康后端。
+ *
+ * 每个后端保持 #NR_PIPE 条长连接。服务器按顺序逐个响应请求，
+ * 因此一条连接上可以连续发送多个请求（流水线），发送时把等待者挂到队尾，
+ * 由该连接的接收线程按顺序把响应交给队首的等待者。
+ *
+ * 等待响应有期限：后端停止响应时请求超时返回，连接被断开，后端标记为宕机，
+ * 中继随即按哈希环改投下一台后端。
+ */
+
+#include <relay/backend.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_BACKEND         64
+#define NR_VNODE            128
+#define NR_PIPE             4
+#define HEALTH_INTERVAL     1
+#define HEALTH_TIMEOUT_MS   500
+#define FORWARD_TIMEOUT_MS  2000
+
+/**
+ * @brief 等待响应的请求
+ */
+typedef struct Waiter {
+    struct Waiter       *next;
+    CityResponseHeader  *response;   /**< 响应写入的位置 */
+    int                  error;      /**< 连接断开时置 1 */
+    sem_t                done;       /**< 响应到达或出错时释放 */
+} Waiter;
+
+/**
+ * @brief 一条流水线连接
+ */
+typedef struct {
+    pthread_mutex_t  lock;           /**< 保护 socket_fd 的发送与等待队列 */
+    int              socket_fd;      /**< 为 -1 时表示未连接 */
+    Waiter          *head;           /**< 等待队列队首，最早发送的请求 */
+    Waiter          *tail;           /**< 等待队列队尾 */
+} Pipe;
+
+/**
+ * @brief 后端服务器
+ */
+typedef struct {
+    char                address_text[32];
+    struct sockaddr_in  address;
+    atomic_int          healthy;
+    atomic_uint         next_pipe;   /**< 轮转选择连接 */
+    Pipe                pipes[NR_PIPE];
+} Backend;
+
+/**
+ * @brief 哈希环上的虚拟节点
+ */
+typedef struct {
+    uint32_t  hash;
+    int       backend;
+} VirtualNode;
+
+static Backend backends[MAX_BACKEND];
+static int n_backend;
+
+static VirtualNode ring[MAX_BACKEND * NR_VNODE];
+static int n_vnode;
+
+/**
+ * @brief FNV-1a 哈希，最多处理 size 个字节或到终结符为止
+ */
+static uint32_t hash_text(const char *text, size_t size)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size && text[i]; i++) {
+        h ^= (uint8_t)text[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int compare_vnode(const void *a, const void *b)
+{
+    uint32_t x = ((const VirtualNode *)a)->hash, y = ((const VirtualNode *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief 添加一个后端服务器
+ * @param address 形如 127.0.0.1:4321 的地址
+ * @return 成功时返回 0，格式错误或数量超限时返回 -1
+ */
+int backend_add(const char *address)
+{
+    if (n_backend >= MAX_BACKEND) {
+        return -1;
+    }
+
+    char ip[16];
+    unsigned port;
+    if (sscanf(address, "%15[^:]:%u", ip, &port) != 2 || port > UINT16_MAX) {
+        return -1;
+    }
+
+    Backend *backend = &backends[n_backend];
+    if (inet_pton(AF_INET, ip, &backend->address.sin_addr) != 1) {
+        return -1;
+    }
+    backend->address.sin_family = AF_INET;
+    backend->address.sin_port = htons((uint16_t)port);
+    snprintf(backend->address_text, sizeof(backend->address_text), "%s:%u", ip, port);
+
+    for (int i = 0; i < NR_PIPE; i++) {
+        pthread_mutex_init(&backend->pipes[i].lock, NULL);
+        backend->pipes[i].socket_fd = -1;
+    }
+
+    n_backend++;
+    return 0;
+}
+
+/**
+ * @brief 建立到后端的 TCP 连接
+ * @return 套接字，失败时返回 -1
+ */
+static int connect_backend(const Backend *backend)
+{
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        return -1;
+    }
+    if (connect(socket_fd, (const struct sockaddr *)&backend->address, sizeof(backend->address))) {
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+/**
+ * @brief 断开连接，并让所有等待者以错误返回，调用者需持有连接锁
+ *
+ * 套接字由接收线程在退出时关闭，避免其编号在接收线程仍在使用时被复用。
+ */
+static void pipe_reset(Pipe *pipe)
+{
+    if (pipe->socket_fd >= 0) {
+        shutdown(pipe->socket_fd, SHUT_RDWR);
+        pipe->socket_fd = -1;
+    }
+
+    while (pipe->head) {
+        Waiter *waiter = pipe->head;
+        pipe->head = waiter->next;
+        waiter->error = 1;
+        sem_post(&waiter->done);
+    }
+    pipe->tail = NULL;
+}
+
+/**
+ * @brief 接收线程参数
+ */
+typedef struct {
+    Backend  *backend;
+    Pipe     *pipe;
+    int       socket_fd;
+} PipeReader;
+
+/**
+ * @brief 连接的接收线程，按顺序把响应交给等待者
+ * @param arg PipeReader 指针，由本线程释放
+ */
+static void *pipe_reader_main_loop(void *arg)
+{
+    PipeReader *reader = arg;
+    Pipe *pipe = reader->pipe;
+    CityResponseHeader response;
+
+    while (recv(reader->socket_fd, &response, sizeof(response), MSG_WAITALL) == sizeof(response)) {
+        pthread_mutex_lock(&pipe->lock);
+        Waiter *waiter = pipe->head;
+        if (waiter) {
+            pipe->head = waiter->next;
+            if (pipe->head == NULL) {
+                pipe->tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        if (waiter == NULL) {
+            fprintf(stderr, "relay: unexpected response from %s\n", reader->backend->address_text);
+            break;
+        }
+        *waiter->response = response;
+        sem_post(&waiter->done);
+    }
+
+    pthread_mutex_lock(&pipe->lock);
+    // 连接可能已被健康检查替换，只清理自己的那一条
+    if (pipe->socket_fd == reader->socket_fd) {
+        if (atomic_exchange(&reader->backend->healthy, 0)) {
+            fprintf(stderr, "relay: backend %s is down\n", reader->backend->address_text);
+        }
+        pipe_reset(pipe);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    close(reader->socket_fd);
+    free(reader);
+    return NULL;
+}
+
+/**
+ * @brief 为未连接的连接槽建立连接并启动接收线程
+ * @return 全部连接可用时返回 0，否则返回 -1
+ */
+static int backend_connect_pipes(Backend *backend)
+{
+    int result = 0;
+    for (int i = 0; i < NR_PIPE; i++) {
+        Pipe *pipe = &backend->pipes[i];
+        pthread_mutex_lock(&pipe->lock);
+        if (pipe->socket_fd < 0) {
+            pipe->socket_fd = connect_backend(backend);
+            if (pipe->socket_fd >= 0) {
+                PipeReader *reader = malloc(sizeof(PipeReader));
+                reader->backend = backend;
+                reader->pipe = pipe;
+                reader->socket_fd = pipe->socket_fd;
+
+                pthread_t tid;
+                pthread_create(&tid, NULL, pipe_reader_main_loop, reader);
+                pthread_detach(tid);
+            }
+            else {
+                result = -1;
+            }
+        }
+        pthread_mutex_unlock(&pipe->lock);
+    }
+    return result;
+}
+
+/**
+ * @brief 用独立的短连接探测后端
+ * @return 后端正常响应时返回 1，否则返回 0
+ */
+static int backend_probe(const Backend *backend)
+{
+    int socket_fd = connect_backend(backend);
+    if (socket_fd < 0) {
+        return 0;
+    }
+
+    struct timeval timeout = {
+        .tv_sec  = HEALTH_TIMEOUT_MS / 1000,
+        .tv_usec = HEALTH_TIMEOUT_MS % 1000 * 1000
+    };
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    CityRequestHeader request;
+    CityResponseHeader response;
+    construct_request(&request, REQUEST_CITY, "", 1);
+
+    int ok = send(socket_fd, &request, sizeof(request), 0) == sizeof(request) &&
+             recv(socket_fd, &response, sizeof(response), MSG_WAITALL) == sizeof(response);
+
+    close(socket_fd);
+    return ok;
+}
+
+/**
+ * @brief 断开后端的全部连接，让排队中的请求立即以错误返回
+ */
+static void backend_reset_pipes(Backend *backend)
+{
+    for (int i = 0; i < NR_PIPE; i++) {
+        Pipe *pipe = &backend->pipes[i];
+        pthread_mutex_lock(&pipe->lock);
+        pipe_reset(pipe);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+}
+
+/**
+ * @brief 健康检查线程
+ *
+ * 定期探测每个后端，探测成功时补齐断开的连接，失败时将其摘除并断开全部连接。
+ * 进程挂起的后端仍会接受连接，只有探测能发现它不再响应。
+ */
+static void *health_main_loop(void *arg)
+{
+    for (;;) {
+        for (int i = 0; i < n_backend; i++) {
+            Backend *backend = &backends[i];
+            int healthy = backend_probe(backend) && backend_connect_pipes(backend) == 0;
+            if (healthy != atomic_exchange(&backend->healthy, healthy)) {
+                fprintf(stderr, "relay: backend %s is %s\n", backend->address_text, healthy ? "up" : "down");
+            }
+            // 先摘除再断开，被唤醒的请求重新路由时不会再选中它
+            if (!healthy) {
+                backend_reset_pipes(backend);
+            }
+        }
+        sleep(HEALTH_INTERVAL);
+    }
+    return arg;
+}
+
+/**
+ * @brief 建立一致性哈希环、连接池，并启动健康检查线程
+ */
+void backend_start(void)
+{
+    for (int i = 0; i < n_backend; i++) {
+        for (int v = 0; v < NR_VNODE; v++) {
+            char key[48];
+            snprintf(key, sizeof(key), "%s#%d", backends[i].address_text, v);
+            ring[n_vnode].hash = hash_text(key, sizeof(key));
+            ring[n_vnode].backend = i;
+            n_vnode++;
+        }
+    }
+    qsort(ring, (size_t)n_vnode, sizeof(ring[0]), compare_vnode);
+
+    for (int i = 0; i < n_backend; i++) {
+        int healthy = backend_connect_pipes(&backends[i]) == 0;
+        atomic_store(&backends[i].healthy, healthy);
+        if (!healthy) {
+            fprintf(stderr, "relay: backend %s is down\n", backends[i].address_text);
+        }
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, health_main_loop, NULL);
+    pthread_detach(tid);
+}
+
+/**
+ * @brief 根据城市名选出负责的后端
+ * @param city_name 城市名，最多 20 字节
+ * @return 后端编号，没有健康后端时返回 -1
+ *
+ * 在环上找到第一个不小于城市哈希的虚拟节点，跳过不健康的后端。
+ */
+int backend_route(const char *city_name)
+{
+    uint32_t h = city_hash(city_name);
+
+    int low = 0, high = n_vnode;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (ring[mid].hash < h) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    for (int i = 0; i < n_vnode; i++) {
+        int backend = ring[(low + i) % n_vnode].backend;
+        if (atomic_load_explicit(&backends[backend].healthy, memory_order_relaxed)) {
+            return backend;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 通过连接池向后端发送一个请求并等待其响应
+ * @param backend  后端编号
+ * @param request  完整的请求报文，保持网络字节序
+ * @param size     请求报文字节数
+ * @param response 响应写入的位置，保持网络字节序
+ * @return 成功时返回 0，连接不可用、中途断开或超时未响应时返回 -1
+ *
+ * 超时的请求仍挂在等待队列中，之后的响应已无法对应，因此断开该连接，
+ * 并把后端标记为宕机，由健康检查在它恢复后重新接入。
+ */
+int backend_forward(int backend, const void *request, size_t size, CityResponseHeader *response)
+{
+    Backend *target = &backends[backend];
+    Pipe *pipe = &target->pipes[atomic_fetch_add(&target->next_pipe, 1) % NR_PIPE];
+
+    Waiter waiter = {
+        .response = response,
+    };
+    sem_init(&waiter.done, 0, 0);
+
+    pthread_mutex_lock(&pipe->lock);
+    if (pipe->socket_fd < 0 || send(pipe->socket_fd, request, size, MSG_NOSIGNAL) != (ssize_t)size) {
+        pipe_reset(pipe);
+        pthread_mutex_unlock(&pipe->lock);
+        sem_destroy(&waiter.done);
+        return -1;
+    }
+    if (pipe->tail) {
+        pipe->tail->next = &waiter;
+    }
+    else {
+        pipe->head = &waiter;
+    }
+    pipe->tail = &waiter;
+    pthread_mutex_unlock(&pipe->lock);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FORWARD_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += FORWARD_TIMEOUT_MS % 1000 * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int result;
+    while ((result = sem_timedwait(&waiter.done, &deadline)) != 0 && errno == EINTR) {
+    }
+
+    if (result != 0) {
+        // 等待者可能已被接收线程取走但尚未释放，此时信号量很快就会到来
+        pthread_mutex_lock(&pipe->lock);
+        Waiter *queued = pipe->head;
+        while (queued && queued != &waiter) {
+            queued = queued->next;
+        }
+        if (queued) {
+            pipe_reset(pipe);
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        if (queued && atomic_exchange(&target->healthy, 0)) {
+            fprintf(stderr, "relay: backend %s timed out\n", target->address_text);
+        }
+        sem_wait(&waiter.done);
+    }
+
+    sem_destroy(&waiter.done);
+    return waiter.error ? -1 : 0;
+}
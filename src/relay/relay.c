@@ -0,0 +1,176 @@
+/**
+ * @file     relay.c
+ * @author   whz
+ * @brief    中继程序入口，按城市把请求分发到多台服务器
+ */
+
+#include <relay/backend.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/**
+ * @brief 描述客户端连接
+ */
+typedef struct {
+    int                 id;         /**< 连接编号 */
+    pthread_t           tid;        /**< 服务线程 ID */
+    int                 socket_fd;  /**< 连接套接字 */
+    struct sockaddr_in  address;    /**< 客户端 IP 地址 */
+    socklen_t           length;     /**< 客户端地址长度 */
+} RelayConnection;
+
+/**
+ * @brief 读完并拒绝一个录入请求
+ * @param link     客户端连接
+ * @param header   录入请求头，保持网络字节序
+ * @param response 拒绝响应，保持网络字节序
+ * @return 成功时返回 0，接收失败时返回 -1
+ *
+ * 录入只能经由各服务端的 Unix 域录入套接字完成，由服务端自己校验对端身份，
+ * 中继无法代为鉴权，因此一律拒绝，但要读完记录以保持报文边界。
+ */
+static int reject_ingest(RelayConnection *link, const CityRequestHeader *header, CityResponseHeader *response)
+{
+    WeatherIngestRecord records[UINT8_MAX];
+    ssize_t size = (ssize_t)(header->date * sizeof(records[0]));
+
+    if (size && recv(link->socket_fd, records, (size_t)size, MSG_WAITALL) != size) {
+        return -1;
+    }
+
+    memset(response, 0, sizeof(*response));
+    response->type = htons(RESPONSE_INGEST_DENY);
+    return 0;
+}
+
+/**
+ * @brief 中继的外层逻辑
+ * @param arg 实际上是 RelayConnection 指针
+ * @return 返回 arg 自身
+ */
+static void *relay_main_loop(void *arg)
+{
+    RelayConnection *link = arg;
+
+    CityRequestHeader request;
+    CityResponseHeader response;
+    while (recv(link->socket_fd, &request, sizeof(request), MSG_WAITALL) == sizeof(request)) {
+        uint16_t type = ntohs(request.type);
+        int result;
+
+        if (type == REQUEST_INGEST) {
+            result = reject_ingest(link, &request, &response);
+        }
+        else if (type == REQUEST_CITY || type == REQUEST_SINGLE_DAY || type == REQUEST_MULTIPLE_DAY) {
+            request.city_name[sizeof(request.city_name) - 1] = '\0';
+            // 转发失败的后端已被摘除，重新路由一次即改投环上的下一台
+            result = -1;
+            for (int attempt = 0; attempt < 2 && result != 0; attempt++) {
+                int backend = backend_route(request.city_name);
+                if (backend < 0) {
+                    break;
+                }
+                result = backend_forward(backend, &request, sizeof(request), &response);
+            }
+        }
+        else {
+            // 订阅要求推送回到同一连接，前缀查询的响应后跟变长的名字列表，中继都不转发
+            memset(&response, 0, sizeof(response));
+            response.type = htons(RESPONSE_UNSUPPORTED);
+            memcpy(response.city_name, request.city_name, sizeof(response.city_name));
+            result = 0;
+        }
+
+        if (result != 0) {
+            fprintf(stderr, "%d: no backend available\n", link->id);
+            break;
+        }
+
+        if (send(link->socket_fd, &response, sizeof(response), MSG_NOSIGNAL) != sizeof(response)) {
+            perror("Failed to send response");
+            break;
+        }
+    }
+
+    close(link->socket_fd);
+    free(link);
+    return NULL;
+}
+
+/**
+ * @brief 初始化中继的监听套接字
+ * @param port_no 端口号
+ * @return 绑定本机地址的监听套接字
+ */
+static int init_relay(uint16_t port_no)
+{
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        perror("Cannot open socket");
+        exit(-1);
+    }
+
+    int reuse = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in relay_address = {
+        .sin_family      = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port        = htons(port_no)
+    };
+
+    if (bind(socket_fd, (struct sockaddr *)&relay_address, sizeof(relay_address))) {
+        perror("Cannot bind");
+        exit(-1);
+    }
+
+    listen(socket_fd, SOMAXCONN);
+
+    return socket_fd;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <port-number> <backend-ip:port> [<backend-ip:port> ...]\n", argv[0]);
+        exit(-1);
+    }
+
+    long port_no = strtol(argv[1], NULL, 10);
+    if (port_no > USHRT_MAX || port_no <= 0) {
+        fprintf(stderr, "ERROR: port number %ld is invalid.\n", port_no);
+        exit(-1);
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (backend_add(argv[i])) {
+            fprintf(stderr, "ERROR: backend address %s is invalid.\n", argv[i]);
+            exit(-1);
+        }
+    }
+    backend_start();
+
+    int listen_socket = init_relay((uint16_t)port_no);
+
+    int count = 0;
+    for (;;) {
+        RelayConnection *link = malloc(sizeof(RelayConnection));
+        link->id = count++;
+        link->length = sizeof(link->address);
+        link->socket_fd = accept(listen_socket, (struct sockaddr *)&link->address, &link->length);
+        if (link->socket_fd < 0) {
+            perror("Failed to accept");
+            free(link);
+            continue;
+        }
+        pthread_create(&link->tid, NULL, relay_main_loop, link);
+        pthread_detach(link->tid);
+    }
+}
@@ -0,0 +1,438 @@
+/**
+ * @file     busy_poll.c
+ * @author   whz
+ * @brief    以忙轮询换取低延迟的服务模式
+ *
+ * 连接按轮转分配给固定数量的轮询线程，每个线程持有一个 epoll 实例。
+ * 线程空闲时以零超时反复调用 epoll_wait，请求到达后无需经过调度器唤醒；
+ * 自旋超过当前窗口仍无请求才阻塞等待。
+ *
+ * 自旋窗口按观察到的请求间隔自适应：阻塞后在预算之内就来了请求，说明多自旋一会儿本可以接住，
+ * 窗口加倍；空闲间隔超过预算，说明自旋纯属浪费，窗口减半。
+ * 低负载时线程几乎不自旋，高负载时窗口撑满预算。
+ *
+ * 每个线程统计自旋、处理请求与阻塞各自花费的时间，定期输出到标准错误。
+ *
+ * 轮询线程从不阻塞在某个连接上：套接字为非阻塞模式，每个连接保存收到一半的请求；
+ * 响应经由连接的发送积压发出。TCP 连接不允许录入，录入请求读完记录后直接拒绝。
+ * 需要等待上游抓取的请求交给工作线程，期间连接暂时移出 epoll，
+ * 以保证同一连接上的响应仍按请求的顺序返回。
+ */
+
+#include <server/busy_poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+/**
+ * @brief 每次 epoll_wait 最多取回的事件数
+ */
+#define MAX_EVENT  64
+
+/**
+ * @brief 自旋窗口增长的最小步长，单位为纳秒
+ */
+#define WINDOW_STEP  1000
+
+/**
+ * @brief 统计输出间隔，单位为纳秒
+ */
+#define REPORT_INTERVAL  (10 * 1000000000LL)
+
+/**
+ * @brief 处理需要等待上游的请求的工作线程数
+ */
+#define NR_WORKER  4
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+/**
+ * @brief 轮询线程的状态
+ */
+typedef struct {
+    int       id;         /**< 线程编号 */
+    int       epoll_fd;   /**< 该线程的 epoll 实例 */
+    int64_t   window;     /**< 当前自旋窗口，单位为纳秒 */
+
+    int64_t   spin_ns;    /**< 自上次输出以来自旋的时间 */
+    int64_t   work_ns;    /**< 自上次输出以来处理请求的时间 */
+    int64_t   block_ns;   /**< 自上次输出以来阻塞的时间 */
+    uint64_t  n_request;  /**< 自上次输出以来处理的请求数 */
+    uint64_t  n_hit;      /**< 在自旋窗口内接住的空闲期数 */
+    uint64_t  n_miss;     /**< 阻塞之后才到达的空闲期数 */
+} Poller;
+
+/**
+ * @brief 轮询线程服务的一个连接
+ */
+typedef struct PolledConnection {
+    Connection               *link;
+    Poller                   *poller;      /**< 负责该连接的轮询线程 */
+    CityRequestHeader         request;     /**< 正在接收的请求 */
+    size_t                    n_read;      /**< 请求已收到的字节数 */
+    size_t                    n_skip;      /**< 被拒绝的录入请求尚未读完的记录字节数 */
+    struct PolledConnection  *next_job;    /**< 工作队列链接 */
+} PolledConnection;
+
+static Poller *pollers;
+static unsigned nr_poller;
+static int64_t budget;       /**< 自旋窗口上限，单位为纳秒 */
+static unsigned next_poller;
+
+/**
+ * @brief 等待工作线程处理的连接，每个连接至多一个请求在队列中
+ */
+static struct {
+    pthread_mutex_t    lock;
+    pthread_cond_t     ready;
+    PolledConnection  *head;
+    PolledConnection  *tail;
+} job_queue = {
+    .lock  = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief 读取单调时钟，单位为纳秒
+ */
+static inline int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief 结束连接上的服务，调用前连接须已移出 epoll
+ */
+static void polled_close(PolledConnection *polled)
+{
+    weather_service_close(polled->link);
+    free(polled);
+}
+
+/**
+ * @brief 把连接放回轮询线程的 epoll
+ * @return 成功时返回 0，失败时返回 -1
+ */
+static int polled_watch(PolledConnection *polled)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = polled };
+    if (epoll_ctl(polled->poller->epoll_fd, EPOLL_CTL_ADD, polled->link->socket_fd, &event)) {
+        perror("Cannot poll connection");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 工作线程，处理需要等待上游的请求后把连接放回轮询线程
+ */
+static void *worker_main_loop(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&job_queue.lock);
+        while (job_queue.head == NULL) {
+            pthread_cond_wait(&job_queue.ready, &job_queue.lock);
+        }
+        PolledConnection *polled = job_queue.head;
+        job_queue.head = polled->next_job;
+        if (job_queue.head == NULL) {
+            job_queue.tail = NULL;
+        }
+        pthread_mutex_unlock(&job_queue.lock);
+
+        if (weather_service_respond(polled->link, &polled->request, RESPOND_DEFERRED) != 0 ||
+            polled_watch(polled) != 0) {
+            polled_close(polled);
+        }
+    }
+
+    return arg;
+}
+
+/**
+ * @brief 把连接当前的请求交给工作线程
+ *
+ * 连接先移出 epoll，处理完之前不再读取它的后续请求。
+ */
+static void defer(PolledConnection *polled)
+{
+    epoll_ctl(polled->poller->epoll_fd, EPOLL_CTL_DEL, polled->link->socket_fd, NULL);
+
+    pthread_mutex_lock(&job_queue.lock);
+    polled->next_job = NULL;
+    if (job_queue.tail) {
+        job_queue.tail->next_job = polled;
+    }
+    else {
+        job_queue.head = polled;
+    }
+    job_queue.tail = polled;
+    pthread_cond_signal(&job_queue.ready);
+    pthread_mutex_unlock(&job_queue.lock);
+}
+
+/**
+ * @brief 读出被拒绝的录入请求的记录，读完后发送拒绝响应
+ * @return 继续服务时返回 0，连接结束时返回 -1
+ */
+static int skip_ingest(PolledConnection *polled)
+{
+    char discard[4096];
+    while (polled->n_skip) {
+        size_t size = polled->n_skip < sizeof(discard) ? polled->n_skip : sizeof(discard);
+        ssize_t n_read = recv(polled->link->socket_fd, discard, size, 0);
+        if (n_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n_read <= 0) {
+            return -1;
+        }
+        polled->n_skip -= (size_t)n_read;
+    }
+
+    CityResponseHeader response = {};
+    construct_response(&response, &polled->request);
+    response.type = RESPONSE_INGEST_DENY;
+    response.n_status = 0;
+    response_hton(&response);
+    struct iovec iov = { .iov_base = &response, .iov_len = sizeof(response) };
+    return connection_send(polled->link, &iov, 1) ? -1 : 0;
+}
+
+/**
+ * @brief 读取连接上已到达的数据，收齐一个请求即处理
+ * @param polled 就绪的连接
+ * @return 继续服务时返回 0，连接结束时返回 -1
+ *
+ * 每次只处理一个请求，避免一个繁忙的连接饿死同一线程上的其它连接。
+ * 请求需要等待上游时交给工作线程，连接在处理完之前不再被轮询。
+ */
+static int serve_polled(PolledConnection *polled)
+{
+    if (polled->n_skip) {
+        return skip_ingest(polled);
+    }
+
+    char *buffer = (char *)&polled->request;
+    ssize_t n_read = recv(polled->link->socket_fd, buffer + polled->n_read, sizeof(polled->request) - polled->n_read, 0);
+    if (n_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n_read <= 0) {
+        return -1;
+    }
+    polled->n_read += (size_t)n_read;
+    if (polled->n_read < sizeof(polled->request)) {
+        return 0;
+    }
+    polled->n_read = 0;
+    polled->poller->n_request++;
+
+    CityRequestHeader *request = &polled->request;
+    request_ntoh(request);
+    request->city_name[sizeof(request->city_name) - 1] = '\0';
+
+    if (request->type == REQUEST_INGEST) {
+        polled->n_skip = request->date * sizeof(WeatherIngestRecord);
+        return skip_ingest(polled);
+    }
+
+    switch (weather_service_respond(polled->link, request, RESPOND_NONBLOCKING)) {
+        case 0:
+            return 0;
+        case 1:
+            defer(polled);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief 服务就绪的连接
+ * @param poller 轮询线程
+ * @param events 就绪事件
+ * @param n      事件个数
+ */
+static void serve_ready(Poller *poller, struct epoll_event *events, int n)
+{
+    for (int i = 0; i < n; i++) {
+        PolledConnection *polled = events[i].data.ptr;
+        if ((events[i].events & EPOLLERR) || serve_polled(polled) != 0) {
+            epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, polled->link->socket_fd, NULL);
+            polled_close(polled);
+        }
+    }
+}
+
+/**
+ * @brief 根据一次空闲期的长度调整自旋窗口
+ * @param poller  轮询线程
+ * @param idle    空闲期长度，单位为纳秒
+ * @param blocked 空闲期内是否阻塞过
+ */
+static void adapt_window(Poller *poller, int64_t idle, int blocked)
+{
+    if (!blocked) {
+        poller->n_hit++;
+        return;
+    }
+
+    poller->n_miss++;
+    if (idle <= budget) {
+        poller->window = poller->window * 2 + WINDOW_STEP;
+        if (poller->window > budget) {
+            poller->window = budget;
+        }
+    }
+    else {
+        poller->window /= 2;
+    }
+}
+
+/**
+ * @brief 输出并清零统计
+ */
+static void report(Poller *poller, int64_t elapsed)
+{
+    if (poller->n_request > 0) {
+        fprintf(stderr, "poller %d: %" PRIu64 " requests, spin %.1f%%, work %.1f%%, blocked %.1f%%, "
+                        "window %" PRId64 "us, idle hit/miss %" PRIu64 "/%" PRIu64 "\n",
+                poller->id, poller->n_request,
+                100.0 * (double)poller->spin_ns / (double)elapsed,
+                100.0 * (double)poller->work_ns / (double)elapsed,
+                100.0 * (double)poller->block_ns / (double)elapsed,
+                poller->window / 1000, poller->n_hit, poller->n_miss);
+    }
+
+    poller->spin_ns = poller->work_ns = poller->block_ns = 0;
+    poller->n_request = poller->n_hit = poller->n_miss = 0;
+}
+
+/**
+ * @brief 轮询线程的主循环
+ * @param arg 实际上是 Poller 指针
+ * @return NULL，不会返回
+ */
+static void *poller_main_loop(void *arg)
+{
+    Poller *poller = arg;
+    struct epoll_event events[MAX_EVENT];
+    int64_t last_report = now_ns();
+
+    for (;;) {
+        // 空闲期：先在窗口内自旋，仍无请求再阻塞
+        int64_t idle_begin = now_ns(), now = idle_begin;
+        int blocked = 0;
+        int n = epoll_wait(poller->epoll_fd, events, MAX_EVENT, 0);
+        while (n == 0 && now - idle_begin < poller->window) {
+            cpu_relax();
+            n = epoll_wait(poller->epoll_fd, events, MAX_EVENT, 0);
+            now = now_ns();
+        }
+        poller->spin_ns += now - idle_begin;
+
+        if (n == 0) {
+            blocked = 1;
+            // 带超时阻塞，使空闲的线程也能按时输出统计
+            n = epoll_wait(poller->epoll_fd, events, MAX_EVENT, 1000);
+            int64_t woken = now_ns();
+            poller->block_ns += woken - now;
+            now = woken;
+        }
+        if (n < 0) {
+            continue;
+        }
+        if (n > 0) {
+            adapt_window(poller, now - idle_begin, blocked);
+        }
+
+        // 工作期：只要有就绪连接就持续处理，不计入空闲
+        while (n > 0) {
+            serve_ready(poller, events, n);
+            n = epoll_wait(poller->epoll_fd, events, MAX_EVENT, 0);
+        }
+        int64_t work_end = now_ns();
+        poller->work_ns += work_end - now;
+
+        if (work_end - last_report >= REPORT_INTERVAL) {
+            report(poller, work_end - last_report);
+            last_report = work_end;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief 启动轮询线程
+ * @param n_poller  轮询线程数，为 0 时不启用忙轮询模式
+ * @param budget_us 空闲时自旋的上限，单位为微秒
+ */
+void busy_poll_init(unsigned n_poller, unsigned budget_us)
+{
+    if (n_poller == 0) {
+        return;
+    }
+
+    nr_poller = n_poller;
+    budget = (int64_t)budget_us * 1000;
+    pollers = calloc(n_poller, sizeof(Poller));
+
+    for (unsigned i = 0; i < n_poller; i++) {
+        Poller *poller = &pollers[i];
+        poller->id = (int)i;
+        poller->window = budget;
+        poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (poller->epoll_fd < 0) {
+            perror("Cannot create epoll instance");
+            exit(-1);
+        }
+
+        pthread_t tid;
+        pthread_create(&tid, NULL, poller_main_loop, poller);
+        pthread_detach(tid);
+    }
+
+    for (int i = 0; i < NR_WORKER; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, worker_main_loop, NULL);
+        pthread_detach(tid);
+    }
+}
+
+/**
+ * @brief 把新连接交给轮询线程
+ * @param link 已接受的连接，引用由轮询线程接管
+ *
+ * 只由监听线程调用。套接字设为非阻塞模式，一个慢速的客户端不会挡住同一线程上的其它连接。
+ * 同时设置 SO_BUSY_POLL，让内核在接收路径上也轮询网卡；没有权限时忽略。
+ */
+void busy_poll_add(Connection *link)
+{
+    PolledConnection *polled = calloc(1, sizeof(PolledConnection));
+    polled->link = link;
+    polled->poller = &pollers[next_poller++ % nr_poller];
+
+    fcntl(link->socket_fd, F_SETFL, fcntl(link->socket_fd, F_GETFL) | O_NONBLOCK);
+    int busy_poll_us = (int)(budget / 1000);
+    setsockopt(link->socket_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us));
+
+    fprintf(stderr, "%d: service start on poller %d\n", link->id, polled->poller->id);
+
+    if (polled_watch(polled)) {
+        polled_close(polled);
+    }
+}
@@ -0,0 +1,125 @@
+/**
+ * @file     city_catalog.c
+ * @author   whz
+ * @brief    按前缀查找城市名的目录
+ *
+ * 目录是城市名的有序数组，每项 20 字节连续存放，前缀查找为一次二分查找加一段顺序扫描。
+ * 存储中的行只增不减且按编号连续分配，目录记下已收录的行数，
+ * 查找时发现存储中有新行才把新名字排序后归并进来，平时只持有读锁。
+ * 下一行还没发布时不加锁也不分配内存；已有线程在归并时其它查找直接使用现有目录。
+ */
+
+#define _GNU_SOURCE
+#include <server/city_catalog.h>
+#include <server/weather_store.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef char CityName[20];
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;   /**< 保证同时只有一个线程归并 */
+static CityName *names;             /**< 有序的城市名 */
+static uint32_t n_name;             /**< 城市名个数 */
+static _Atomic uint32_t covered;    /**< 已收录的行数，编号更小的行都已在目录中 */
+
+static int compare_name(const void *a, const void *b)
+{
+    return strncmp(a, b, sizeof(CityName));
+}
+
+/**
+ * @brief 把存储中新增的行归并进目录
+ *
+ * 遇到尚未发布的行就停下，留到下次查找时再收录。
+ * 同时只有一个线程归并：names 只由它修改，它不加读写锁就能读取现有目录，
+ * 在锁外排序归并出新数组后，只在写锁下替换指针。
+ */
+static void refresh(void)
+{
+    uint32_t count = weather_store_count();
+    uint32_t begin = atomic_load_explicit(&covered, memory_order_acquire);
+    CityName probe;
+    if (begin == count || weather_store_row_name(begin, probe) < 0) {
+        return;
+    }
+
+    if (pthread_mutex_trylock(&merge_lock)) {
+        return;
+    }
+
+    begin = atomic_load_explicit(&covered, memory_order_relaxed);
+    if (begin == count) {
+        pthread_mutex_unlock(&merge_lock);
+        return;
+    }
+
+    CityName *fresh = malloc((count - begin) * sizeof(CityName));
+    uint32_t end = begin;
+    while (end < count && weather_store_row_name(end, fresh[end - begin]) == 0) {
+        end++;
+    }
+    uint32_t n_fresh = end - begin;
+    qsort(fresh, n_fresh, sizeof(CityName), compare_name);
+
+    CityName *merged = malloc((n_name + n_fresh) * sizeof(CityName));
+    uint32_t i = 0, j = 0, k = 0;
+    while (i < n_name || j < n_fresh) {
+        if (j == n_fresh || (i < n_name && compare_name(names[i], fresh[j]) < 0)) {
+            memcpy(merged[k++], names[i++], sizeof(CityName));
+        }
+        else {
+            memcpy(merged[k++], fresh[j++], sizeof(CityName));
+        }
+    }
+    free(fresh);
+
+    // 写者优先，持续不断的查找也不会让替换无限等待
+    pthread_rwlock_wrlock(&lock);
+    CityName *old = names;
+    names = merged;
+    n_name += n_fresh;
+    pthread_rwlock_unlock(&lock);
+
+    free(old);
+    atomic_store_explicit(&covered, end, memory_order_release);
+    pthread_mutex_unlock(&merge_lock);
+}
+
+/**
+ * @brief 查找以 prefix 开头的城市
+ * @param prefix 前缀，空串匹配所有城市
+ * @param out    输出数组，至少 max 个元素
+ * @param max    最多返回的城市数
+ * @return 找到的城市数
+ */
+int city_catalog_prefix(const char *prefix, CityNameRecord *out, int max)
+{
+    refresh();
+
+    size_t length = strnlen(prefix, sizeof(CityName) - 1);
+
+    pthread_rwlock_rdlock(&lock);
+
+    // 第一个不小于前缀的名字
+    uint32_t low = 0, high = n_name;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (strncmp(names[middle], prefix, length) < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    int n_found = 0;
+    for (uint32_t i = low; i < n_name && n_found < max && !strncmp(names[i], prefix, length); i++) {
+        memcpy(out[n_found++].city_name, names[i], sizeof(CityName));
+    }
+
+    pthread_rwlock_unlock(&lock);
+    return n_found;
+}
@@ -0,0 +1,394 @@
+/**
+ * @file     forecast.c
+ * @author   whz
+ * @brief    上游天气源的异步抓取与请求合并
+ *
+ * 每个 (城市, 起始日期, 天数) 对应一个 Flight，记录是否正在抓取以及上次抓取完成的时间。
+ * 同一个 Flight 同时至多有一次抓取：并发的请求要么直接使用存储中的旧数据，
+ * 要么等待这次抓取完成，因此同一城市的大量并发请求只产生一次上游访问。
+ * 抓取由固定数量的工作线程执行，线程数即同时进行的上游访问的上限，多余的排队等待。
+ * 数据过期后，只要存储中还有旧数据就立即用旧数据响应，同时在后台刷新。
+ *
+ * 上游没有某个城市的数据也是一个结果，同样缓存到过期为止，期间同名的请求不再访问上游；
+ * 上游出错则只在 #RETRY_MS 之内不再重试。
+ * 每个桶最多容纳 #MAX_BUCKET_FLIGHT 个 Flight，查找时顺带释放已过期的空闲 Flight，
+ * 桶满时淘汰最久未刷新的空闲 Flight，大量不同的城市名也只占用有限的内存。
+ *
+ * 抓取完成时把结果的有效期同时写入一张用顺序锁保护的提示表，
+ * 数据仍然新鲜的查询只读提示表即可返回，不必获取桶锁。
+ */
+
+#include <server/forecast.h>
+#include <server/weather_store.h>
+#include <server/subscription.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define NR_BUCKET          4096
+#define NR_HINT            (NR_BUCKET * 4)
+#define NR_LOCK            64
+#define MAX_BUCKET_FLIGHT  16
+#define RETRY_MS           1000
+
+/**
+ * @brief 一组合并的抓取请求
+ */
+typedef struct Flight {
+    char            city_name[20];
+    uint8_t         first_day;
+    uint8_t         n_day;
+    uint32_t        hash;        /**< 键的散列值，决定所在的桶、提示表项和使用哪把锁 */
+    int             in_flight;   /**< 是否正在抓取或排队 */
+    int             n_waiter;    /**< 等待本次抓取完成的线程数 */
+    int             failed;      /**< 上次抓取是否出错 */
+    uint64_t        refreshed;   /**< 上次抓取完成的时间，单位为毫秒，0 表示从未抓取 */
+    pthread_cond_t  done;        /**< 抓取完成时广播 */
+    struct Flight  *next;        /**< 桶内链表 */
+    struct Flight  *next_job;    /**< 抓取队列链表 */
+} Flight;
+
+static ForecastBackend *upstream;
+static uint64_t ttl_ms;
+
+static Flight *buckets[NR_BUCKET];
+static pthread_mutex_t bucket_locks[NR_LOCK];
+
+/**
+ * @brief 提示表项，记录某个键上次抓取结果的有效期
+ *
+ * 按 hash % #NR_HINT 定位，NR_HINT 是 NR_BUCKET 的倍数，同一表项的写者总持有同一把桶锁。
+ * 不同的键可能落在同一表项，后写的覆盖先写的，读者比对键后才使用。
+ */
+typedef struct {
+    _Atomic uint32_t  seq;             /**< 顺序锁计数，奇数表示正在写 */
+    char              city_name[20];
+    uint8_t           first_day;
+    uint8_t           n_day;
+    uint64_t          fresh_until;     /**< 结果失效的时间，单位为毫秒 */
+} Hint;
+
+static Hint hints[NR_HINT];
+
+/**
+ * @brief 等待抓取的队列
+ */
+static struct {
+    pthread_mutex_t  lock;
+    pthread_cond_t   ready;
+    Flight          *head;
+    Flight          *tail;
+} job_queue = {
+    .lock  = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief 当前时间，单位为毫秒
+ */
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief 抓取结果的有效时长，出错的结果只在 #RETRY_MS 之内有效
+ */
+static uint64_t valid_ms(int failed)
+{
+    return failed && RETRY_MS < ttl_ms ? RETRY_MS : ttl_ms;
+}
+
+/**
+ * @brief 把 Flight 上次抓取结果的有效期写入提示表，调用者需持有桶锁
+ */
+static void hint_store(const Flight *flight)
+{
+    Hint *hint = &hints[flight->hash % NR_HINT];
+    uint32_t seq = atomic_load_explicit(&hint->seq, memory_order_relaxed);
+    atomic_store_explicit(&hint->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(hint->city_name, flight->city_name, sizeof(hint->city_name));
+    hint->first_day = flight->first_day;
+    hint->n_day = flight->n_day;
+    hint->fresh_until = flight->refreshed + valid_ms(flight->failed);
+    atomic_store_explicit(&hint->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * @brief 不加锁地查询提示表，判断某个键的数据是否仍然新鲜
+ * @return 提示表记录的正是该键且尚未失效时返回 1，否则返回 0
+ *
+ * 表项正在被写时直接返回 0，由调用者走加锁的路径。
+ */
+static int hint_fresh(uint32_t hash, const char *city, uint8_t first_day, uint8_t n_day, uint64_t now)
+{
+    Hint *hint = &hints[hash % NR_HINT];
+    uint32_t begin = atomic_load_explicit(&hint->seq, memory_order_acquire);
+    if (begin & 1) {
+        return 0;
+    }
+    int fresh = now < hint->fresh_until && hint->first_day == first_day && hint->n_day == n_day &&
+                !strncmp(hint->city_name, city, sizeof(hint->city_name));
+    atomic_thread_fence(memory_order_acquire);
+    return fresh && atomic_load_explicit(&hint->seq, memory_order_relaxed) == begin;
+}
+
+/**
+ * @brief 把 Flight 加入抓取队列
+ */
+static void submit(Flight *flight)
+{
+    pthread_mutex_lock(&job_queue.lock);
+    flight->next_job = NULL;
+    if (job_queue.tail) {
+        job_queue.tail->next_job = flight;
+    }
+    else {
+        job_queue.head = flight;
+    }
+    job_queue.tail = flight;
+    pthread_cond_signal(&job_queue.ready);
+    pthread_mutex_unlock(&job_queue.lock);
+}
+
+/**
+ * @brief 抓取线程，逐个执行队列中的抓取并写入存储
+ */
+static void *fetch_main_loop(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&job_queue.lock);
+        while (job_queue.head == NULL) {
+            pthread_cond_wait(&job_queue.ready, &job_queue.lock);
+        }
+        Flight *flight = job_queue.head;
+        job_queue.head = flight->next_job;
+        if (job_queue.head == NULL) {
+            job_queue.tail = NULL;
+        }
+        pthread_mutex_unlock(&job_queue.lock);
+
+        WeatherStatus status[NR_HISTORY_DAY];
+        memset(status, 0xff, sizeof(status));
+
+        int failed = upstream->fetch(upstream, flight->city_name, flight->first_day, flight->n_day, status) < 0;
+        if (failed) {
+            fprintf(stderr, "forecast: %s failed to fetch %s\n", upstream->name, flight->city_name);
+        }
+
+        for (uint8_t i = 0; i < flight->n_day; i++) {
+            if (status[i].weather_type < NR_WEATHER) {
+                uint8_t date = (uint8_t)(flight->first_day + i);
+                if (weather_store_update(flight->city_name, date, status[i].weather_type, status[i].temperature) > 0 &&
+                    date == 1) {
+                    subscription_notify(flight->city_name);
+                }
+            }
+        }
+        subscription_flush();
+
+        // 失败也记录完成时间，在重试间隔之内不再重复访问上游
+        pthread_mutex_t *lock = &bucket_locks[flight->hash % NR_BUCKET % NR_LOCK];
+        pthread_mutex_lock(lock);
+        flight->in_flight = 0;
+        flight->failed = failed;
+        flight->refreshed = now_ms() | 1;
+        hint_store(flight);
+        pthread_cond_broadcast(&flight->done);
+        pthread_mutex_unlock(lock);
+    }
+
+    return arg;
+}
+
+/**
+ * @brief 设置上游天气源
+ * @param backend      上游天气源，为 NULL 时只使用存储中已有的数据
+ * @param max_inflight 同时进行的抓取数上限
+ * @param ttl          数据的有效期，单位为秒
+ */
+void forecast_init(ForecastBackend *backend, unsigned max_inflight, unsigned ttl)
+{
+    if (backend == NULL) {
+        return;
+    }
+
+    upstream = backend;
+    ttl_ms = (uint64_t)ttl * 1000;
+
+    for (int i = 0; i < NR_LOCK; i++) {
+        pthread_mutex_init(&bucket_locks[i], NULL);
+    }
+
+    for (unsigned i = 0; i < (max_inflight ? max_inflight : 1); i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, fetch_main_loop, NULL);
+        pthread_detach(tid);
+    }
+}
+
+/**
+ * @brief 判断 Flight 上次抓取的结果是否仍然有效
+ */
+static int flight_fresh(const Flight *flight, uint64_t now)
+{
+    return flight->refreshed && now - flight->refreshed < valid_ms(flight->failed);
+}
+
+/**
+ * @brief 判断 Flight 是否可以释放，即没有抓取在进行也没有线程在等待
+ */
+static int flight_idle(const Flight *flight)
+{
+    return !flight->in_flight && flight->n_waiter == 0;
+}
+
+/**
+ * @brief 从桶中摘下并释放 Flight，调用者需持有桶锁
+ * @param link 指向该 Flight 的链表指针
+ */
+static void flight_free(Flight **link)
+{
+    Flight *flight = *link;
+    *link = flight->next;
+    pthread_cond_destroy(&flight->done);
+    free(flight);
+}
+
+/**
+ * @brief 查找或创建 Flight，调用者需持有桶锁
+ * @return 对应的 Flight，桶已满且没有可淘汰的 Flight 时返回 NULL
+ *
+ * 查找途中释放已过期的空闲 Flight；需要创建而桶已满时，淘汰最久未刷新的空闲 Flight。
+ */
+static Flight *flight_get(uint32_t hash, const char *city, uint8_t first_day, uint8_t n_day, uint64_t now)
+{
+    uint32_t bucket = hash % NR_BUCKET;
+    Flight **victim = NULL;
+    int n_flight = 0;
+
+    for (Flight **link = &buckets[bucket]; *link; ) {
+        Flight *flight = *link;
+        if (!strncmp(flight->city_name, city, sizeof(flight->city_name)) &&
+            flight->first_day == first_day && flight->n_day == n_day) {
+            return flight;
+        }
+        if (flight_idle(flight) && !flight_fresh(flight, now)) {
+            flight_free(link);
+            continue;
+        }
+        if (flight_idle(flight) && (victim == NULL || flight->refreshed < (*victim)->refreshed)) {
+            victim = link;
+        }
+        n_flight++;
+        link = &flight->next;
+    }
+
+    if (n_flight >= MAX_BUCKET_FLIGHT) {
+        if (victim == NULL) {
+            return NULL;
+        }
+        flight_free(victim);
+    }
+
+    Flight *flight = calloc(1, sizeof(Flight));
+    strncpy(flight->city_name, city, sizeof(flight->city_name) - 1);
+    flight->first_day = first_day;
+    flight->n_day = n_day;
+    flight->hash = hash;
+    pthread_cond_init(&flight->done, NULL);
+    flight->next = buckets[bucket];
+    buckets[bucket] = flight;
+    return flight;
+}
+
+/**
+ * @brief 按需发起抓取，必要时等待其完成
+ * @param city      城市名
+ * @param first_day 起始日期距离
+ * @param n_day     天数
+ * @param wait      没有任何数据时是否等待抓取完成
+ * @return 数据可以立即用于响应时返回 0，需要等待而 wait 为 0 时返回 -1
+ *
+ * 数据新鲜时直接返回；过期但有旧数据时发起后台刷新并立即返回；
+ * 没有任何数据时发起抓取（或加入正在进行的抓取），按 wait 决定是否等待其完成。
+ * 桶中的 Flight 都在抓取或被等待时不访问上游，只用存储中已有的数据响应。
+ */
+static int ensure(const char *city, uint8_t first_day, uint8_t n_day, int wait)
+{
+    if (upstream == NULL || first_day == 0 || n_day == 0 || first_day + n_day - 1 > NR_HISTORY_DAY) {
+        return 0;
+    }
+
+    uint32_t hash = city_hash(city) ^ (uint32_t)(first_day << 8 | n_day) * 2654435769u;
+    if (hint_fresh(hash, city, first_day, n_day, now_ms())) {
+        return 0;
+    }
+
+    pthread_mutex_t *lock = &bucket_locks[hash % NR_BUCKET % NR_LOCK];
+    pthread_mutex_lock(lock);
+
+    uint64_t now = now_ms();
+    Flight *flight = flight_get(hash, city, first_day, n_day, now);
+    if (flight == NULL || flight_fresh(flight, now)) {
+        pthread_mutex_unlock(lock);
+        return 0;
+    }
+
+    if (!flight->in_flight) {
+        flight->in_flight = 1;
+        submit(flight);
+    }
+
+    // 有旧数据就不等待，录入或快照恢复的数据也算
+    int result = 0;
+    WeatherStatus stale[NR_HISTORY_DAY];
+    if (flight->refreshed == 0 && weather_store_lookup(city, first_day, n_day, stale) != 0) {
+        if (wait) {
+            flight->n_waiter++;
+            while (flight->in_flight) {
+                pthread_cond_wait(&flight->done, lock);
+            }
+            flight->n_waiter--;
+        }
+        else {
+            result = -1;
+        }
+    }
+
+    pthread_mutex_unlock(lock);
+    return result;
+}
+
+/**
+ * @brief 保证存储中城市连续若干天的数据可用于响应
+ * @param city      城市名
+ * @param first_day 起始日期距离
+ * @param n_day     天数
+ *
+ * 没有任何数据时等待抓取完成，可能阻塞上游延迟那么久。
+ */
+void forecast_ensure(const char *city, uint8_t first_day, uint8_t n_day)
+{
+    ensure(city, first_day, n_day, 1);
+}
+
+/**
+ * @brief 按需发起抓取但不等待
+ * @param city      城市名
+ * @param first_day 起始日期距离
+ * @param n_day     天数
+ * @return 数据可以立即用于响应时返回 0，需要等待抓取完成时返回 -1
+ *
+ * 供不能阻塞的调用者在处理请求之前判断是否需要把请求交给其它线程。
+ */
+int forecast_prefetch(const char *city, uint8_t first_day, uint8_t n_day)
+{
+    return ensure(city, first_day, n_day, 0);
+}
@@ -0,0 +1,81 @@
+/**
+ * @file     forecast_file.c
+ * @author   whz
+ * @brief    以文本文件模拟的上游天气源
+ *
+ * 文件每行一条记录：城市名 日期距离 天气类型 温度，例如 "nanjing 1 2 18"。
+ * 每次抓取都重新读取整个文件，并可以额外延迟一段时间，用来模拟缓慢的上游。
+ */
+
+#include <server/forecast.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @brief 文件天气源的参数
+ */
+typedef struct {
+    const char *path;        /**< 数据文件路径 */
+    unsigned    latency_ms;  /**< 每次抓取额外的延迟 */
+} FileContext;
+
+/**
+ * @brief 从文件中读取城市连续若干天的天气
+ * @return 取得数据的天数，文件无法打开时返回 -1
+ */
+static int file_fetch(ForecastBackend *backend, const char *city,
+                      uint8_t first_day, uint8_t n_day, WeatherStatus *out)
+{
+    FileContext *context = backend->context;
+
+    if (context->latency_ms) {
+        usleep(context->latency_ms * 1000);
+    }
+
+    FILE *fp = fopen(context->path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    int n_found = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char name[20];
+        unsigned date, weather_type;
+        int temperature;
+        if (sscanf(line, "%19s %u %u %d", name, &date, &weather_type, &temperature) != 4 ||
+            strcmp(name, city) || date < first_day || date >= first_day + n_day ||
+            weather_type >= NR_WEATHER || temperature < INT8_MIN || temperature > INT8_MAX) {
+            continue;
+        }
+
+        WeatherStatus *status = &out[date - first_day];
+        n_found += status->weather_type >= NR_WEATHER;
+        status->weather_type = (uint8_t)weather_type;
+        status->temperature = (int8_t)temperature;
+    }
+
+    fclose(fp);
+    return n_found;
+}
+
+/**
+ * @brief 创建文件天气源
+ * @param path       数据文件路径
+ * @param latency_ms 每次抓取额外的延迟，单位为毫秒
+ * @return 天气源对象，进程结束前一直有效
+ */
+ForecastBackend *forecast_file_backend(const char *path, unsigned latency_ms)
+{
+    FileContext *context = malloc(sizeof(FileContext));
+    context->path = path;
+    context->latency_ms = latency_ms;
+
+    ForecastBackend *backend = malloc(sizeof(ForecastBackend));
+    backend->name = "file";
+    backend->fetch = file_fetch;
+    backend->context = context;
+    return backend;
+}
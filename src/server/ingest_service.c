@@ -0,0 +1,108 @@
+/**
+ * @file     ingest_service.c
+ * @author   whz
+ * @brief    录入套接字
+ *
+ * 录入请求只在 Unix 域套接字上受理。套接字文件权限为 0660，只有服务器的用户与用户组能够连接；
+ * 连接建立后再用 SO_PEERCRED 取得对端进程的 uid 与 gid，与服务器的有效 uid、gid 之一相同
+ * 或为 root 时才视为受信任的数据源。通过校验的连接与 TCP 连接使用同一服务逻辑，其余请求照常处理。
+ */
+
+#define _GNU_SOURCE
+#include <server/ingest_service.h>
+#include <server/weather_service.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/**
+ * @brief 校验对端进程的身份
+ * @param socket_fd Unix 域连接套接字
+ * @return 允许录入时返回 1，否则返回 0
+ */
+static int peer_trusted(int socket_fd)
+{
+    struct ucred credential;
+    socklen_t length = sizeof(credential);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_PEERCRED, &credential, &length)) {
+        perror("Cannot get peer credential");
+        return 0;
+    }
+
+    return credential.uid == 0 || credential.uid == geteuid() || credential.gid == getegid();
+}
+
+/**
+ * @brief 录入套接字的监听循环
+ * @param arg 实际上是监听套接字
+ * @return NULL
+ */
+static void *ingest_accept_loop(void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+
+    for (;;) {
+        int socket_fd = accept(listen_fd, NULL, NULL);
+        if (socket_fd < 0) {
+            perror("Failed to accept ingest client");
+            continue;
+        }
+
+        if (!peer_trusted(socket_fd)) {
+            fprintf(stderr, "ingest: rejected untrusted peer\n");
+            close(socket_fd);
+            continue;
+        }
+
+        Connection *link = connection_new();
+        link->socket_fd = socket_fd;
+        link->trusted = 1;
+        pthread_t tid;
+        pthread_create(&tid, NULL, weather_service_main_loop, link);
+        pthread_detach(tid);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief 启动录入套接字
+ * @param path Unix 域套接字路径，已存在的文件会被替换
+ *
+ * 如果发生错误会直接结束程序。
+ */
+void ingest_service_start(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "ERROR: socket path %s is too long.\n", path);
+        exit(-1);
+    }
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("Cannot open ingest socket");
+        exit(-1);
+    }
+
+    // 在绑定前收紧 umask，避免套接字文件在 chmod 之前短暂地对其他用户可写
+    unlink(path);
+    mode_t mask = umask(0117);
+    int error = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if (error || chmod(path, 0660)) {
+        perror("Cannot bind ingest socket");
+        exit(-1);
+    }
+
+    listen(listen_fd, 5);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, ingest_accept_loop, (void *)(intptr_t)listen_fd);
+    pthread_detach(tid);
+}
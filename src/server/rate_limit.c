@@ -0,0 +1,125 @@
+/**
+ * @file     rate_limit.c
+ * @author   whz
+ * @brief    按客户端 IP 的令牌桶限速
+ *
+ * 令牌桶保存在一张组相联的表中：IP 哈希到一个组，每组 #NR_WAY 个桶，
+ * 组内未命中时淘汰最久未访问的桶（组内 LRU）。表共约一百三十万个桶，大小固定。
+ * 每组连同自己的自旋锁正好占一条缓存行，一次查询只触及一条缓存行，
+ * 不同组的请求互不阻塞。
+ * 令牌不由后台线程补充，而是在访问时按距上次访问的时间一次性补足。
+ */
+
+#include <server/rate_limit.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SET_BITS   18
+#define NR_SET     (1u << SET_BITS)
+#define NR_WAY     5
+
+/**
+ * @brief 一个客户端的令牌桶
+ */
+typedef struct {
+    uint32_t  ip;          /**< 客户端地址，主机字节序，0 表示空桶 */
+    float     tokens;      /**< 上次访问后剩余的令牌数 */
+    uint32_t  last;        /**< 上次访问的时间，单位为毫秒，允许回绕 */
+} Bucket;
+
+/**
+ * @brief 组相联表的一组，与锁一起占一条缓存行
+ */
+typedef struct {
+    pthread_spinlock_t  lock;
+    Bucket              buckets[NR_WAY];
+} __attribute__((aligned(64))) BucketSet;
+
+static BucketSet sets[NR_SET];
+
+static float refill_rate;   /**< 每毫秒补充的令牌数，为 0 时不限速 */
+static float capacity;      /**< 桶容量 */
+
+/**
+ * @brief 设置限速参数
+ * @param rate  每秒允许的请求数，为 0 时不限速
+ * @param burst 允许的突发请求数，为 0 时等于 rate
+ */
+void rate_limit_init(unsigned rate, unsigned burst)
+{
+    if (rate == 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < NR_SET; i++) {
+        pthread_spin_init(&sets[i].lock, PTHREAD_PROCESS_PRIVATE);
+    }
+
+    refill_rate = (float)rate / 1000.0f;
+    capacity = (float)(burst ? burst : rate);
+}
+
+/**
+ * @brief 当前时间，单位为毫秒
+ *
+ * 使用粗粒度时钟，读取开销很小，精度为毫秒级，足够用于补充令牌。
+ */
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+}
+
+/**
+ * @brief 为客户端消耗一个令牌
+ * @param ip 客户端地址，主机字节序
+ * @return 允许本次请求时返回 1，应当限速时返回 0
+ */
+int rate_limit_acquire(uint32_t ip)
+{
+    if (refill_rate == 0) {
+        return 1;
+    }
+
+    // 斐波那契散列，取高位作为组号
+    uint32_t index = (uint32_t)(ip * 2654435769u) >> (32 - SET_BITS);
+    BucketSet *set = &sets[index];
+    uint32_t now = now_ms();
+
+    pthread_spin_lock(&set->lock);
+
+    Bucket *bucket = NULL, *victim = &set->buckets[0];
+    for (int i = 0; i < NR_WAY; i++) {
+        if (set->buckets[i].ip == ip) {
+            bucket = &set->buckets[i];
+            break;
+        }
+        // 空桶优先，否则淘汰距上次访问最久的桶
+        if (victim->ip != 0 && (set->buckets[i].ip == 0 || now - set->buckets[i].last > now - victim->last)) {
+            victim = &set->buckets[i];
+        }
+    }
+
+    if (bucket == NULL) {
+        // 新客户端或已被淘汰的客户端从满桶开始
+        bucket = victim;
+        bucket->ip = ip;
+        bucket->tokens = capacity;
+    }
+    else {
+        bucket->tokens += (float)(now - bucket->last) * refill_rate;
+        if (bucket->tokens > capacity) {
+            bucket->tokens = capacity;
+        }
+    }
+    bucket->last = now;
+
+    int allowed = bucket->tokens >= 1.0f;
+    if (allowed) {
+        bucket->tokens -= 1.0f;
+    }
+
+    pthread_spin_unlock(&set->lock);
+    return allowed;
+}
@@ -0,0 +1,95 @@
+/**
+ * @file     request_handler.c
+ * @author   whz
+ * @brief    与传输方式无关的请求处理
+ *
+ * 只依赖存储与上游数据源，不做任何 I/O。TCP、共享内存与忙轮询等各种传输方式共用，
+ * 也可以在进程内直接驱动，单独测量请求处理本身的开销。
+ */
+
+#include <server/request_handler.h>
+#include <server/weather_store.h>
+#include <server/forecast.h>
+#include <string.h>
+
+/**
+ * @brief 从存储中读取连续若干天的天气并设置响应类型
+ * @param response  待填写的响应报文
+ * @param request   请求报文
+ * @param first_day 起始日期距离
+ * @param n_day     天数
+ * @param type      数据齐全时的响应类型
+ */
+static void fill_weather(CityResponseHeader *response, const CityRequestHeader *request,
+                         uint8_t first_day, uint8_t n_day, uint16_t type)
+{
+    forecast_ensure(request->city_name, first_day, n_day);
+    switch (weather_store_lookup(request->city_name, first_day, n_day, response->status)) {
+        case 0:
+            response->type = type;
+            break;
+        case -1:
+            response->type = RESPONSE_NO_CITY;
+            break;
+        default:
+            response->type = RESPONSE_NO_DAY;
+            memset(response->status, 0, sizeof(response->status));
+            break;
+    }
+}
+
+/**
+ * @brief 处理一个请求
+ * @param request  请求报文，已转换为主机字节序，city_name 以 '\0' 结尾
+ * @param response 响应报文，主机字节序，发送前由调用者转换
+ * @param trace    本次请求的追踪记录，不采样时为 NULL
+ * @return 已处理时返回 0；请求类型需要连接状态时返回 -1，此时响应只经过 construct_response() 初始化
+ */
+int handle_request(const CityRequestHeader *request, CityResponseHeader *response, TraceRecord *trace)
+{
+    construct_response(response, request);
+    TRACE_STAMP(trace, TRACE_CONSTRUCT);
+
+    switch (request->type) {
+        case REQUEST_CITY:
+            // 与天数查询共用合并抓取与否定缓存，只在上游有的城市也能先被确认存在
+            forecast_ensure(request->city_name, 1, 1);
+            response->type = (uint16_t)(weather_store_contains(request->city_name) ? RESPONSE_CITY_EXISTS : RESPONSE_NO_CITY);
+            return 0;
+        case REQUEST_SINGLE_DAY:
+            fill_weather(response, request, request->date, 1, RESPONSE_SINGLE_DAY);
+            return 0;
+        case REQUEST_MULTIPLE_DAY:
+            if (request->date > sizeof(response->status) / sizeof(response->status[0])) {
+                response->n_status = sizeof(response->status) / sizeof(response->status[0]);
+            }
+            fill_weather(response, request, 1, response->n_status, RESPONSE_MULTIPLE_DAY);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief 判断处理请求是否需要等待上游抓取
+ * @param request 请求报文，已转换为主机字节序
+ * @return 需要等待时返回 1，否则返回 0
+ *
+ * 需要的数据不在存储中时顺带发起抓取，之后 handle_request() 只需等待其完成。
+ * 供不能阻塞的调用者先行判断，把需要等待的请求交给其它线程处理。
+ */
+int request_would_block(const CityRequestHeader *request)
+{
+    uint8_t max_day = sizeof(((CityResponseHeader *)NULL)->status) / sizeof(WeatherStatus);
+
+    switch (request->type) {
+        case REQUEST_CITY:
+            return forecast_prefetch(request->city_name, 1, 1) != 0;
+        case REQUEST_SINGLE_DAY:
+            return forecast_prefetch(request->city_name, request->date, 1) != 0;
+        case REQUEST_MULTIPLE_DAY:
+            return forecast_prefetch(request->city_name, 1, request->date < max_day ? request->date : max_day) != 0;
+        default:
+            return 0;
+    }
+}
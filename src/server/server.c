@@ -5,9 +5,19 @@
  */
 
 #include "server/weather_service.h"
+#include "server/weather_store.h"
+#include "server/snapshot.h"
+#include "server/subscription.h"
+#include "server/rate_limit.h"
+#include "server/forecast.h"
+#include "server/trace.h"
+#include "server/shm_service.h"
+#include "server/busy_poll.h"
+#include "server/ingest_service.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <unistd.h>
 
 /**
  * @brief 初始化服务器，获得监听套接字
@@ -16,25 +26,130 @@ static int init_server(uint16_t port_no);
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <port-number>\n", argv[0]);
+    const char *snapshot_path = NULL;
+    unsigned snapshot_interval = 60;
+    unsigned rate = 0, burst = 0;
+    const char *upstream_path = NULL;
+    unsigned upstream_latency = 0, max_fetch = 16, ttl = 60;
+    const char *trace_path = "trace.json";
+    unsigned trace_every = 0;
+    const char *shm_path = NULL;
+    unsigned n_poller = 0, spin_budget = 50;
+    const char *ingest_path = NULL;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:i:r:b:u:L:F:E:t:T:m:P:B:I:")) != -1) {
+        switch (option) {
+            case 's':
+                snapshot_path = optarg;
+                break;
+            case 'i':
+                snapshot_interval = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                rate = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                burst = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'u':
+                upstream_path = optarg;
+                break;
+            case 'L':
+                upstream_latency = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'F':
+                max_fetch = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'E':
+                ttl = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                trace_every = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                trace_path = optarg;
+                break;
+            case 'm':
+                shm_path = optarg;
+                break;
+            case 'P':
+                n_poller = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                spin_budget = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'I':
+                ingest_path = optarg;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        int indent;
+        fprintf(stderr, "Usage: %n%s [options] <port-number>\n", &indent, argv[0]);
+        fprintf(stderr, "%*s-s <snapshot-file>        # map snapshot at startup and save periodically\n", indent, "");
+        fprintf(stderr, "%*s-i <seconds>              # snapshot interval, 0 disables saving\n", indent, "");
+        fprintf(stderr, "%*s-r <requests-per-second>  # per-client rate limit\n", indent, "");
+        fprintf(stderr, "%*s-b <burst>                # per-client burst size\n", indent, "");
+        fprintf(stderr, "%*s-u <upstream-file>        # fetch missing weather from upstream file\n", indent, "");
+        fprintf(stderr, "%*s-L <milliseconds>         # simulated upstream latency\n", indent, "");
+        fprintf(stderr, "%*s-F <count>                # max concurrent upstream fetches\n", indent, "");
+        fprintf(stderr, "%*s-E <seconds>              # upstream data expiry\n", indent, "");
+        fprintf(stderr, "%*s-t <N>                    # trace 1 in N requests, dump on SIGUSR1\n", indent, "");
+        fprintf(stderr, "%*s-T <trace-file>           # trace output, default trace.json\n", indent, "");
+        fprintf(stderr, "%*s-m <socket-path>          # serve same-host clients over shared memory\n", indent, "");
+        fprintf(stderr, "%*s-P <threads>              # busy-polling mode with dedicated poller threads\n", indent, "");
+        fprintf(stderr, "%*s-B <microseconds>         # max spin before a poller blocks, default 50\n", indent, "");
+        fprintf(stderr, "%*s-I <socket-path>          # accept ingest from same-user feeders on a unix socket\n", indent, "");
         exit(-1);
     }
 
-    long port_no = strtol(argv[1], NULL, 10);
+    long port_no = strtol(argv[optind], NULL, 10);
     if (port_no > USHRT_MAX && port_no < 0) {
         fprintf(stderr, "ERROR: port number %ld is invalid.\n", port_no);
         exit(-1);
     }
 
+    // 需要在创建任何线程之前屏蔽 SIGUSR1
+    trace_init(trace_every, trace_path);
+
+    weather_store_init();
+    if (snapshot_path == NULL || snapshot_load(snapshot_path) != 0) {
+        weather_store_seed();
+    }
+    if (snapshot_path != NULL && snapshot_interval > 0) {
+        snapshot_start(snapshot_path, snapshot_interval);
+    }
+
+    subscription_init();
+    rate_limit_init(rate, burst);
+    forecast_init(upstream_path ? forecast_file_backend(upstream_path, upstream_latency) : NULL, max_fetch, ttl);
+
+    if (shm_path != NULL) {
+        shm_service_start(shm_path);
+    }
+    if (ingest_path != NULL) {
+        ingest_service_start(ingest_path);
+    }
+
+    busy_poll_init(n_poller, spin_budget);
+
     int listen_socket = init_server((uint16_t)port_no);
 
-    int count = 0;
     for(;;) {
-        Connection *link = malloc(sizeof(Connection));
-        link->id = count++;
+        Connection *link = connection_new();
         link->socket_fd = accept(listen_socket, (struct sockaddr *)&link->address, &link->length);
-        pthread_create(&link->tid, NULL, weather_service_main_loop, link);
+        if (n_poller > 0) {
+            busy_poll_add(link);
+            continue;
+        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, weather_service_main_loop, link);
+        pthread_detach(tid);
     }
 }
 
@@ -55,6 +170,10 @@ static int init_server(uint16_t port_no)
         exit(-1);
     }
 
+    // 允许后端重启后立即重新绑定同一端口
+    int reuse = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     struct sockaddr_in server_address = {
         .sin_family      = AF_INET,
         .sin_addr.s_addr = INADDR_ANY,
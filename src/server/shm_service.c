@@ -0,0 +1,195 @@
+/**
+ * @file     shm_service.c
+ * @author   whz
+ * @brief    同一主机客户端的共享内存服务
+ *
+ * 客户端先连接 Unix 域套接字，服务器为其创建一段 memfd 共享内存，
+ * 初始化请求环与响应环后用 SCM_RIGHTS 把描述符交给客户端。
+ * 此后请求与响应都经由共享内存传递，Unix 域套接字只用来发现客户端退出。
+ */
+
+#define _GNU_SOURCE
+#include <server/shm_service.h>
+#include <server/request_handler.h>
+#include <lib/shm_channel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * @brief 等待请求的超时，超时后检查客户端是否已退出
+ */
+#define IDLE_TIMEOUT_MS  100
+
+/**
+ * @brief 响应环满时等待客户端取出的最长时间，超时后放弃该通道
+ */
+#define PUSH_TIMEOUT_MS  1000
+
+/**
+ * @brief 创建共享内存通道并把描述符发送给客户端
+ * @param socket_fd Unix 域连接套接字
+ * @return 映射后的通道，失败时返回 NULL
+ */
+static ShmChannel *create_channel(int socket_fd)
+{
+    int memory_fd = memfd_create("weather-shm", MFD_CLOEXEC);
+    if (memory_fd < 0) {
+        perror("Cannot create shared memory");
+        return NULL;
+    }
+
+    ShmChannel *channel = MAP_FAILED;
+    if (ftruncate(memory_fd, sizeof(ShmChannel)) == 0) {
+        channel = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+    }
+    if (channel == MAP_FAILED) {
+        perror("Cannot map shared memory");
+        close(memory_fd);
+        return NULL;
+    }
+    channel->magic = SHM_CHANNEL_MAGIC;
+
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr message = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &memory_fd, sizeof(int));
+
+    ssize_t n_send = sendmsg(socket_fd, &message, MSG_NOSIGNAL);
+    close(memory_fd);
+    if (n_send != 1) {
+        perror("Failed to send shared memory");
+        munmap(channel, sizeof(ShmChannel));
+        return NULL;
+    }
+
+    return channel;
+}
+
+/**
+ * @brief 判断客户端是否已经关闭 Unix 域连接
+ */
+static int client_gone(int socket_fd)
+{
+    struct pollfd fd = { .fd = socket_fd, .events = POLLIN };
+    return poll(&fd, 1, 0) != 0;
+}
+
+/**
+ * @brief 共享内存通道的服务循环
+ * @param arg 实际上是 Unix 域连接套接字
+ * @return NULL
+ *
+ * 只支持与连接无关的查询请求，其余类型回复 RESPONSE_UNSUPPORTED。
+ * 限速按 TCP 对端 IP 计算，共享内存通道上的请求不限速。
+ */
+static void *shm_service_main_loop(void *arg)
+{
+    int socket_fd = (int)(intptr_t)arg;
+    ShmChannel *channel = create_channel(socket_fd);
+
+    while (channel) {
+        ShmRequestSlot slot;
+        if (shm_ring_pop(&channel->request_ring, channel->requests, sizeof(slot), &slot, IDLE_TIMEOUT_MS)) {
+            if (client_gone(socket_fd)) {
+                break;
+            }
+            continue;
+        }
+
+        CityRequestHeader *request = &slot.request;
+        request_ntoh(request);
+        request->city_name[sizeof(request->city_name) - 1] = '\0';
+
+        ShmResponseSlot reply = { .sequence = slot.sequence };
+        if (handle_request(request, &reply.response, NULL)) {
+            reply.response.type = RESPONSE_UNSUPPORTED;
+        }
+
+        // 客户端不再取出响应时放弃该通道，不让服务线程一直等在满的环上
+        response_hton(&reply.response);
+        if (shm_ring_push(&channel->response_ring, channel->responses, sizeof(reply), &reply, PUSH_TIMEOUT_MS)) {
+            fprintf(stderr, "shared memory client stopped reading responses\n");
+            break;
+        }
+    }
+
+    if (channel) {
+        munmap(channel, sizeof(ShmChannel));
+    }
+    close(socket_fd);
+    return NULL;
+}
+
+/**
+ * @brief 共享内存服务的监听循环
+ * @param arg 实际上是监听套接字
+ * @return NULL
+ */
+static void *shm_accept_loop(void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+
+    for (;;) {
+        int socket_fd = accept(listen_fd, NULL, NULL);
+        if (socket_fd < 0) {
+            perror("Failed to accept shared memory client");
+            continue;
+        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, shm_service_main_loop, (void *)(intptr_t)socket_fd);
+        pthread_detach(tid);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief 启动共享内存服务
+ * @param path Unix 域套接字路径，已存在的文件会被替换
+ *
+ * 如果发生错误会直接结束程序。
+ */
+void shm_service_start(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "ERROR: socket path %s is too long.\n", path);
+        exit(-1);
+    }
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("Cannot open unix socket");
+        exit(-1);
+    }
+
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address))) {
+        perror("Cannot bind unix socket");
+        exit(-1);
+    }
+
+    listen(listen_fd, 5);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, shm_accept_loop, (void *)(intptr_t)listen_fd);
+    pthread_detach(tid);
+}
@@ -0,0 +1,282 @@
+/**
+ * @file     snapshot.c
+ * @author   whz
+ * @brief    天气存储的快照持久化
+ *
+ * 快照文件布局（各段按 #SNAPSHOT_ALIGN 对齐，以便直接映射）：
+ *
+ *     | SnapshotHeader | 全部分片的表项 | 行数组 |
+ *
+ * 后台线程逐行在顺序锁保护下复制，写入临时文件后原子地重命名，不影响请求处理。
+ * 启动时校验文件后，将表项与行以写时复制的方式映射到存储的地址上，
+ * 存储直接以快照为底本继续服务，无需逐条重建。
+ */
+
+#include <server/snapshot.h>
+#include <server/weather_store.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC    "WSNAPSHT"
+#define SNAPSHOT_VERSION  3
+
+/**
+ * @brief 段对齐，是常见页大小的公倍数
+ */
+#define SNAPSHOT_ALIGN    (64 * 1024)
+
+/**
+ * @brief 写快照时每批复制的行数
+ */
+#define ROW_BATCH         256
+
+#define ALIGN_UP(x, a)    (((x) + (a) - 1) / (a) * (a))
+
+/**
+ * @brief 快照文件头
+ */
+typedef struct {
+    char      magic[8];         /**< 固定为 #SNAPSHOT_MAGIC */
+    uint32_t  version;          /**< 格式版本 */
+    uint32_t  row_size;         /**< 每行字节数，与存储布局不一致时拒绝加载 */
+    uint64_t  index_size;       /**< 表项字节数 */
+    uint32_t  max_row;          /**< 行数上限 */
+    uint32_t  n_row;            /**< 快照中的行数 */
+    int64_t   created;          /**< 创建时间 */
+    uint64_t  checksum;         /**< 表项与行的校验和 */
+    uint64_t  header_checksum;  /**< 以上字段的校验和，计算时本字段为 0 */
+} SnapshotHeader;
+
+/**
+ * @brief 后台线程参数
+ */
+typedef struct {
+    const char *path;
+    unsigned    interval;
+} SnapshotTask;
+
+/**
+ * @brief 按 8 字节字计算的 FNV-1a 校验和
+ * @param hash 之前的校验和，首次使用 #checksum_init
+ * @param data 数据，长度为 8 的倍数
+ * @param size 字节数
+ * @return 新的校验和
+ */
+static uint64_t checksum(uint64_t hash, const void *data, size_t size)
+{
+    const uint64_t *word = data;
+    for (size_t i = 0; i < size / sizeof(*word); i++) {
+        hash = (hash ^ word[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static const uint64_t checksum_init = 0xcbf29ce484222325ull;
+
+/**
+ * @brief 计算文件头的校验和
+ */
+static uint64_t header_checksum(const SnapshotHeader *header)
+{
+    SnapshotHeader copy = *header;
+    copy.header_checksum = 0;
+    return checksum(checksum_init, &copy, sizeof(copy));
+}
+
+/**
+ * @brief 将存储写入快照文件
+ * @param path 快照文件路径
+ * @return 成功时返回 0，失败时返回 -1
+ *
+ * 先写入 path.tmp，落盘后重命名为 path，保证 path 总是完整的快照。
+ */
+int snapshot_save(const char *path)
+{
+    WeatherStoreLayout layout;
+    weather_store_layout(&layout);
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(temp_path, "wb");
+    if (fp == NULL) {
+        perror("Cannot create snapshot");
+        return -1;
+    }
+
+    void *index = malloc(layout.index_size);
+    char *batch = malloc(ROW_BATCH * layout.row_size);
+
+    SnapshotHeader header = {
+        .magic      = SNAPSHOT_MAGIC,
+        .version    = SNAPSHOT_VERSION,
+        .row_size   = (uint32_t)layout.row_size,
+        .index_size = layout.index_size,
+        .max_row    = layout.max_row,
+        .created    = time(NULL),
+    };
+
+    // 表项与行数一起复制，编号在 n_row 之内的行都已发布；之后再复制行
+    header.n_row = weather_store_copy_index(index);
+    uint64_t sum = checksum(checksum_init, index, layout.index_size);
+
+    int error = fseek(fp, SNAPSHOT_ALIGN, SEEK_SET) ||
+                fwrite(index, layout.index_size, 1, fp) != 1;
+
+    for (uint32_t id = 0; !error && id < header.n_row; id += ROW_BATCH) {
+        uint32_t n = header.n_row - id < ROW_BATCH ? header.n_row - id : ROW_BATCH;
+        for (uint32_t i = 0; i < n; i++) {
+            weather_store_copy_row(id + i, batch + i * layout.row_size);
+        }
+        sum = checksum(sum, batch, n * layout.row_size);
+        error = fwrite(batch, layout.row_size, n, fp) != n;
+    }
+
+    header.checksum = sum;
+    header.header_checksum = header_checksum(&header);
+
+    off_t file_size = SNAPSHOT_ALIGN + (off_t)layout.index_size +
+                      (off_t)ALIGN_UP((size_t)header.n_row * layout.row_size, SNAPSHOT_ALIGN);
+    error = error ||
+            fseek(fp, 0, SEEK_SET) ||
+            fwrite(&header, sizeof(header), 1, fp) != 1 ||
+            fflush(fp) ||
+            ftruncate(fileno(fp), file_size) ||
+            fsync(fileno(fp));
+
+    free(batch);
+    free(index);
+
+    if (fclose(fp) || error) {
+        perror("Failed to write snapshot");
+        unlink(temp_path);
+        return -1;
+    }
+
+    if (rename(temp_path, path)) {
+        perror("Failed to rename snapshot");
+        unlink(temp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 将快照文件映射为存储
+ * @param path 快照文件路径
+ * @return 成功时返回 0，文件不存在或无效时返回 -1，此时存储保持原样
+ *
+ * 需要在 weather_store_init() 之后、处理任何请求之前调用。
+ */
+int snapshot_load(const char *path)
+{
+    WeatherStoreLayout layout;
+    weather_store_layout(&layout);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    SnapshotHeader header;
+    struct stat info;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &info)) {
+        fprintf(stderr, "snapshot %s: cannot read header\n", path);
+        close(fd);
+        return -1;
+    }
+
+    off_t rows_offset = SNAPSHOT_ALIGN + (off_t)layout.index_size;
+    size_t rows_size = (size_t)header.n_row * layout.row_size;
+
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+        header.header_checksum != header_checksum(&header) ||
+        header.version != SNAPSHOT_VERSION ||
+        header.row_size != layout.row_size ||
+        header.index_size != layout.index_size ||
+        header.max_row != layout.max_row ||
+        header.n_row > layout.max_row ||
+        info.st_size < rows_offset + (off_t)rows_size) {
+        fprintf(stderr, "snapshot %s: incompatible or corrupted header\n", path);
+        close(fd);
+        return -1;
+    }
+
+    char *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Cannot map snapshot");
+        close(fd);
+        return -1;
+    }
+
+    uint64_t sum = checksum(checksum_init, data + SNAPSHOT_ALIGN, layout.index_size);
+    sum = checksum(sum, data + rows_offset, rows_size);
+    munmap(data, (size_t)info.st_size);
+
+    if (sum != header.checksum) {
+        fprintf(stderr, "snapshot %s: checksum mismatch\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // 写时复制映射，之后的更新不会写回快照文件
+    if (mmap(layout.index, layout.index_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, SNAPSHOT_ALIGN) == MAP_FAILED ||
+        (rows_size && mmap(layout.rows, ALIGN_UP(rows_size, SNAPSHOT_ALIGN), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_FIXED, fd, rows_offset) == MAP_FAILED)) {
+        perror("Cannot map snapshot into store");
+        exit(-1);
+    }
+
+    close(fd);
+    weather_store_adopt(header.n_row);
+    return 0;
+}
+
+/**
+ * @brief 后台快照线程
+ * @param arg SnapshotTask 指针
+ */
+static void *snapshot_main_loop(void *arg)
+{
+    SnapshotTask *task = arg;
+
+    for (;;) {
+        sleep(task->interval);
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if (snapshot_save(task->path) == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            fprintf(stderr, "snapshot: saved to %s in %ld ms\n", task->path,
+                    (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / 1000000);
+        }
+    }
+
+    return arg;
+}
+
+/**
+ * @brief 启动后台快照线程
+ * @param path     快照文件路径
+ * @param interval 快照间隔，单位为秒
+ */
+void snapshot_start(const char *path, unsigned interval)
+{
+    SnapshotTask *task = malloc(sizeof(SnapshotTask));
+    task->path = path;
+    task->interval = interval;
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, snapshot_main_loop, task);
+    pthread_detach(tid);
+}
@@ -0,0 +1,402 @@
+/**
+ * @file     subscription.c
+ * @author   whz
+ * @brief    城市天气订阅与推送
+ *
+ * 订阅表按城市名哈希分桶，每个城市记录订阅它的连接及其在连接订阅列表中的位置。
+ * 城市当天的数据变化时，只在对应连接的 pending 位图中置位，并把连接挂入推送队列；
+ * 一批录入结束后唤醒推送线程，由它把每个连接积攒的全部更新拼成一次发送。
+ *
+ * 推送线程从不阻塞在某个连接上：发送一律不等待，发不完的部分进入连接的积压，
+ * 推送线程用 epoll 等待这些连接可写后继续发送。积压超限的订阅者被断开，
+ * 一个不读数据的客户端不会拖慢其它订阅者，也不会挡住它自己的响应。
+ */
+
+#include <server/subscription.h>
+#include <server/weather_store.h>
+#include <lib/proxy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define NR_BUCKET  1024
+#define NR_LOCK    64
+#define MAX_EVENT  64
+
+/**
+ * @brief 订阅某个城市的一个连接
+ */
+typedef struct Subscriber {
+    Connection         *link;
+    int                 index;      /**< 在 link->subscriptions 中的下标 */
+    struct Subscriber  *next;
+} Subscriber;
+
+/**
+ * @brief 一个被订阅的城市
+ */
+typedef struct Topic {
+    char                city_name[20];
+    Subscriber         *subscribers;
+    struct Topic       *next;
+} Topic;
+
+static Topic *buckets[NR_BUCKET];
+static pthread_mutex_t bucket_locks[NR_LOCK];
+
+/**
+ * @brief 推送队列，元素为待推送的连接，每个连接持有一个引用
+ */
+static struct {
+    pthread_mutex_t  lock;
+    Connection      *head;
+} push_queue = {
+    .lock  = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * @brief 推送线程的 epoll 实例，监听唤醒事件与有积压的连接
+ */
+static int push_epoll_fd;
+
+/**
+ * @brief 唤醒推送线程的事件，在 epoll 中以空指针标识
+ */
+static int wake_fd;
+
+/**
+ * @brief 查找城市对应的订阅项，调用者需持有桶锁
+ * @param create 不存在时是否创建
+ */
+static Topic *find_topic(uint32_t bucket, const char *city, int create)
+{
+    for (Topic *topic = buckets[bucket]; topic; topic = topic->next) {
+        if (!strncmp(topic->city_name, city, sizeof(topic->city_name))) {
+            return topic;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    Topic *topic = calloc(1, sizeof(Topic));
+    strncpy(topic->city_name, city, sizeof(topic->city_name) - 1);
+    topic->next = buckets[bucket];
+    buckets[bucket] = topic;
+    return topic;
+}
+
+/**
+ * @brief 从城市的订阅者中移除连接
+ */
+static void remove_subscriber(const char *city, Connection *link)
+{
+    uint32_t bucket = city_hash(city) % NR_BUCKET;
+    pthread_mutex_lock(&bucket_locks[bucket % NR_LOCK]);
+
+    Topic *topic = find_topic(bucket, city, 0);
+    for (Subscriber **p = topic ? &topic->subscribers : NULL; p && *p; p = &(*p)->next) {
+        if ((*p)->link == link) {
+            Subscriber *subscriber = *p;
+            *p = subscriber->next;
+            free(subscriber);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&bucket_locks[bucket % NR_LOCK]);
+}
+
+/**
+ * @brief 发送连接积攒的全部更新
+ * @param link    连接
+ * @param updates 拼接更新的缓冲区，#MAX_SUBSCRIPTION 个元素
+ *
+ * 积压超限说明订阅者跟不上推送，断开连接，由它的服务线程完成清理。
+ */
+static void push_updates(Connection *link, CityResponseHeader *updates)
+{
+    unsigned pending = atomic_exchange(&link->pending, 0);
+
+    int n_update = 0;
+    pthread_mutex_lock(&link->sub_lock);
+    for (int i = 0; i < MAX_SUBSCRIPTION; i++) {
+        if (!(pending & (1u << i)) || link->subscriptions[i][0] == '\0') {
+            continue;
+        }
+
+        CityRequestHeader request = {
+            .type = REQUEST_SINGLE_DAY,
+            .date = 1,
+        };
+        strncpy(request.city_name, link->subscriptions[i], sizeof(request.city_name) - 1);
+
+        CityResponseHeader *update = &updates[n_update];
+        memset(update, 0, sizeof(*update));
+        construct_response(update, &request);
+        if (weather_store_lookup(request.city_name, 1, 1, update->status) == 0) {
+            update->type = RESPONSE_PUSH_UPDATE;
+            response_hton(update);
+            n_update++;
+        }
+    }
+    pthread_mutex_unlock(&link->sub_lock);
+
+    struct iovec iov = { .iov_base = updates, .iov_len = (size_t)n_update * sizeof(updates[0]) };
+    if (n_update && connection_send(link, &iov, 1)) {
+        fprintf(stderr, "%d: subscriber falls behind, disconnect\n", link->id);
+        shutdown(link->socket_fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * @brief 在对端可写时发送连接的积压
+ * @param link 有积压的连接
+ *
+ * 积压发完或连接出错时停止监听，释放 subscription_backlog() 取得的引用。
+ * 停止监听与判断积压为空在同一把锁下，不会与新的积压错过。
+ */
+static void flush_backlog(Connection *link)
+{
+    pthread_mutex_lock(&link->send_lock);
+
+    ssize_t n_send = send(link->socket_fd, link->backlog, link->n_backlog, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n_send < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        link->n_backlog = 0;
+        shutdown(link->socket_fd, SHUT_RDWR);
+    }
+    else if (n_send > 0) {
+        link->n_backlog -= (size_t)n_send;
+        memmove(link->backlog, link->backlog + n_send, link->n_backlog);
+    }
+
+    int done = link->n_backlog == 0;
+    if (done) {
+        epoll_ctl(push_epoll_fd, EPOLL_CTL_DEL, link->socket_fd, NULL);
+    }
+    pthread_mutex_unlock(&link->send_lock);
+
+    if (done) {
+        connection_put(link);
+    }
+}
+
+/**
+ * @brief 推送线程
+ *
+ * 被唤醒时取走整个推送队列，对每个连接把积攒的更新拼成一个缓冲区一次发出；
+ * 有积压的连接可写时继续发送积压。
+ */
+static void *push_main_loop(void *arg)
+{
+    CityResponseHeader updates[MAX_SUBSCRIPTION];
+    struct epoll_event events[MAX_EVENT];
+
+    for (;;) {
+        int n = epoll_wait(push_epoll_fd, events, MAX_EVENT, -1);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr) {
+                flush_backlog(events[i].data.ptr);
+                continue;
+            }
+
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) != sizeof(count)) {
+                continue;
+            }
+
+            pthread_mutex_lock(&push_queue.lock);
+            Connection *link = push_queue.head;
+            push_queue.head = NULL;
+            pthread_mutex_unlock(&push_queue.lock);
+
+            while (link) {
+                Connection *next = link->next_dirty;
+                // 先清除排队标记，之后的变化会让连接重新入队
+                atomic_store(&link->queued, 0);
+                push_updates(link, updates);
+                connection_put(link);
+                link = next;
+            }
+        }
+    }
+
+    return arg;
+}
+
+/**
+ * @brief 初始化订阅表，启动推送线程
+ */
+void subscription_init(void)
+{
+    for (int i = 0; i < NR_LOCK; i++) {
+        pthread_mutex_init(&bucket_locks[i], NULL);
+    }
+
+    push_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (push_epoll_fd < 0 || wake_fd < 0 || epoll_ctl(push_epoll_fd, EPOLL_CTL_ADD, wake_fd, &event)) {
+        perror("Cannot create push events");
+        exit(-1);
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, push_main_loop, NULL);
+    pthread_detach(tid);
+}
+
+/**
+ * @brief 为连接订阅城市
+ * @param link 连接
+ * @param city 城市名
+ * @return 成功或已经订阅时返回 0，订阅数达到上限时返回 -1
+ *
+ * 只由连接自己的服务线程调用。
+ */
+int subscription_add(Connection *link, const char *city)
+{
+    int index = -1;
+
+    pthread_mutex_lock(&link->sub_lock);
+    for (int i = 0; i < MAX_SUBSCRIPTION; i++) {
+        if (!strncmp(link->subscriptions[i], city, sizeof(link->subscriptions[i]))) {
+            pthread_mutex_unlock(&link->sub_lock);
+            return 0;
+        }
+        if (index < 0 && link->subscriptions[i][0] == '\0') {
+            index = i;
+        }
+    }
+    if (index >= 0) {
+        strncpy(link->subscriptions[index], city, sizeof(link->subscriptions[index]) - 1);
+    }
+    pthread_mutex_unlock(&link->sub_lock);
+
+    if (index < 0) {
+        return -1;
+    }
+
+    Subscriber *subscriber = malloc(sizeof(Subscriber));
+    subscriber->link = link;
+    subscriber->index = index;
+
+    uint32_t bucket = city_hash(city) % NR_BUCKET;
+    pthread_mutex_lock(&bucket_locks[bucket % NR_LOCK]);
+    Topic *topic = find_topic(bucket, city, 1);
+    subscriber->next = topic->subscribers;
+    topic->subscribers = subscriber;
+    pthread_mutex_unlock(&bucket_locks[bucket % NR_LOCK]);
+
+    return 0;
+}
+
+/**
+ * @brief 取消连接对城市的订阅
+ * @param link 连接
+ * @param city 城市名，未订阅时忽略
+ */
+void subscription_remove(Connection *link, const char *city)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&link->sub_lock);
+    for (int i = 0; i < MAX_SUBSCRIPTION; i++) {
+        if (link->subscriptions[i][0] && !strncmp(link->subscriptions[i], city, sizeof(link->subscriptions[i]))) {
+            link->subscriptions[i][0] = '\0';
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&link->sub_lock);
+
+    if (found) {
+        remove_subscriber(city, link);
+    }
+}
+
+/**
+ * @brief 取消连接的全部订阅
+ * @param link 连接
+ *
+ * 返回后订阅表中不再引用该连接，推送队列中的引用由推送线程释放。
+ */
+void subscription_drop(Connection *link)
+{
+    for (int i = 0; i < MAX_SUBSCRIPTION; i++) {
+        char city[sizeof(link->subscriptions[i])];
+        pthread_mutex_lock(&link->sub_lock);
+        memcpy(city, link->subscriptions[i], sizeof(city));
+        link->subscriptions[i][0] = '\0';
+        pthread_mutex_unlock(&link->sub_lock);
+
+        if (city[0]) {
+            remove_subscriber(city, link);
+        }
+    }
+}
+
+/**
+ * @brief 标记城市当天的数据发生变化
+ * @param city 城市名
+ *
+ * 只记录待推送的订阅并把连接挂入推送队列，真正的发送在 subscription_flush() 之后。
+ */
+void subscription_notify(const char *city)
+{
+    uint32_t bucket = city_hash(city) % NR_BUCKET;
+    pthread_mutex_lock(&bucket_locks[bucket % NR_LOCK]);
+
+    Topic *topic = find_topic(bucket, city, 0);
+    for (Subscriber *subscriber = topic ? topic->subscribers : NULL; subscriber; subscriber = subscriber->next) {
+        Connection *link = subscriber->link;
+        atomic_fetch_or(&link->pending, 1u << subscriber->index);
+        if (atomic_exchange(&link->queued, 1) == 0) {
+            connection_get(link);
+            pthread_mutex_lock(&push_queue.lock);
+            link->next_dirty = push_queue.head;
+            push_queue.head = link;
+            pthread_mutex_unlock(&push_queue.lock);
+        }
+    }
+
+    pthread_mutex_unlock(&bucket_locks[bucket % NR_LOCK]);
+}
+
+/**
+ * @brief 唤醒推送线程
+ */
+void subscription_flush(void)
+{
+    pthread_mutex_lock(&push_queue.lock);
+    int ready = push_queue.head != NULL;
+    pthread_mutex_unlock(&push_queue.lock);
+
+    uint64_t one = 1;
+    if (ready && write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Failed to wake push thread");
+    }
+}
+
+/**
+ * @brief 把出现积压的连接交给推送线程
+ * @param link 积压由空变为非空的连接，调用者持有其发送锁
+ *
+ * 监听期间持有一个引用，保证套接字在积压发完之前不被关闭。
+ */
+void subscription_backlog(Connection *link)
+{
+    connection_get(link);
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = link };
+    if (epoll_ctl(push_epoll_fd, EPOLL_CTL_ADD, link->socket_fd, &event)) {
+        perror("Cannot poll backlog");
+        link->n_backlog = 0;
+        connection_put(link);
+    }
+}
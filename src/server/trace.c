@@ -0,0 +1,193 @@
+/**
+ * @file     trace.c
+ * @author   whz
+ * @brief    请求处理各阶段的采样追踪
+ *
+ * 每个线程独立计数，每 trace_interval 个请求采样一个。
+ * 采样记录写入固定大小的环形缓冲区：写者用原子加法领取槽位，
+ * 槽位带有类似顺序锁的序号，导出时跳过正在写入或已被覆盖的槽位，全程无锁。
+ * 收到 SIGUSR1 时把缓冲区导出为 Chrome trace-event JSON，可用 chrome://tracing 或 Perfetto 打开。
+ */
+
+#include <server/trace.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define TRACE_CAPACITY  65536
+
+/**
+ * @brief 环形缓冲区的槽位
+ */
+typedef struct {
+    _Atomic uint64_t  seq;     /**< 奇数表示正在写入，偶数时为 2 * (领取序号 + 1) */
+    TraceRecord       record;
+} TraceSlot;
+
+unsigned trace_interval;
+
+static TraceSlot ring[TRACE_CAPACITY];
+static _Atomic uint64_t head;
+
+static uint64_t clock_base;       /**< 时钟零点 */
+static double ticks_per_us = 1;   /**< 每微秒的时钟读数 */
+
+static __thread unsigned countdown;
+
+/**
+ * @brief 阶段名称，下标为阶段结束的打点
+ */
+static const char *stage_names[NR_TRACE_STAMP] = {
+    [TRACE_RECV_END]  = "recv",
+    [TRACE_DECODE]    = "decode",
+    [TRACE_CONSTRUCT] = "construct_response",
+    [TRACE_LOOKUP]    = "lookup",
+    [TRACE_SEND]      = "send",
+};
+
+/**
+ * @brief 用单调时钟标定追踪时钟的频率
+ */
+static void calibrate(void)
+{
+    struct timespec begin, end, pause = { .tv_nsec = 20 * 1000000 };
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    uint64_t ticks = trace_clock();
+    nanosleep(&pause, NULL);
+    ticks = trace_clock() - ticks;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double us = (double)(end.tv_sec - begin.tv_sec) * 1e6 + (double)(end.tv_nsec - begin.tv_nsec) / 1e3;
+    ticks_per_us = (double)ticks / us;
+    clock_base = trace_clock();
+}
+
+/**
+ * @brief 导出线程，每收到一次 SIGUSR1 导出一次
+ */
+static void *dump_main_loop(void *arg)
+{
+    const char *path = arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    for (;;) {
+        int signal_no;
+        if (sigwait(&set, &signal_no) == 0 && trace_dump(path) == 0) {
+            fprintf(stderr, "trace: dumped to %s\n", path);
+        }
+    }
+
+    return arg;
+}
+
+/**
+ * @brief 设置采样间隔与输出文件
+ * @param interval 每 interval 个请求采样一个，为 0 时关闭
+ * @param path     导出文件路径
+ *
+ * 在当前线程屏蔽 SIGUSR1，之后创建的线程都继承该屏蔽，由导出线程用 sigwait 接收。
+ */
+void trace_init(unsigned interval, const char *path)
+{
+    if (interval == 0) {
+        return;
+    }
+
+    calibrate();
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, dump_main_loop, (void *)path);
+    pthread_detach(tid);
+
+    trace_interval = interval;
+}
+
+/**
+ * @brief 决定当前线程的本次请求是否采样
+ * @param record 采样时使用的记录
+ * @return 采样时返回 record，否则返回 NULL
+ */
+TraceRecord *trace_sample(TraceRecord *record)
+{
+    if (countdown > 0) {
+        countdown--;
+        return NULL;
+    }
+
+    countdown = trace_interval - 1;
+    memset(record, 0, sizeof(*record));
+    return record;
+}
+
+/**
+ * @brief 将采样完成的记录写入缓冲区
+ * @param record 采样记录
+ */
+void trace_commit(const TraceRecord *record)
+{
+    uint64_t index = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    TraceSlot *slot = &ring[index % TRACE_CAPACITY];
+
+    atomic_store_explicit(&slot->seq, 2 * index + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->record = *record;
+    atomic_store_explicit(&slot->seq, 2 * index + 2, memory_order_release);
+}
+
+/**
+ * @brief 将缓冲区中的记录导出为 Chrome trace-event JSON
+ * @param path 导出文件路径
+ * @return 成功时返回 0，失败时返回 -1
+ *
+ * 每个阶段导出为一个完整事件（ph 为 X），时间单位为微秒，tid 为连接编号。
+ */
+int trace_dump(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("Cannot create trace file");
+        return -1;
+    }
+
+    uint64_t end = atomic_load_explicit(&head, memory_order_acquire);
+    uint64_t begin = end > TRACE_CAPACITY ? end - TRACE_CAPACITY : 0;
+    int first = 1;
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (uint64_t index = begin; index < end; index++) {
+        TraceSlot *slot = &ring[index % TRACE_CAPACITY];
+        TraceRecord record;
+
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        record = slot->record;
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != 2 * index + 2 || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+
+        for (int point = TRACE_RECV_END; point < NR_TRACE_STAMP; point++) {
+            uint64_t from = record.stamp[point - 1], to = record.stamp[point];
+            if (from == 0 || to < from) {
+                continue;
+            }
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"args\":{\"type\":\"0x%04x\"}}",
+                    first ? "" : ",\n", stage_names[point], record.connection,
+                    (double)(from - clock_base) / ticks_per_us, (double)(to - from) / ticks_per_us, record.type);
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    return fclose(fp) ? -1 : 0;
+}
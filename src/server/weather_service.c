@@ -10,96 +10,370 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <lib/proxy.h>
+#include <server/weather_store.h>
+#include <server/subscription.h>
+#include <server/rate_limit.h>
+#include <server/request_handler.h>
+#include <server/trace.h>
+#include <server/city_catalog.h>
+#include <arpa/inet.h>
+#include <errno.h>
 
 /**
- * @brief 固定的城市集合
+ * @brief 每个连接最多积压的字节数
+ *
+ * 约合 800 个响应。推送频繁而对端迟迟不读时，积压超限即断开连接，
+ * 以免慢速的订阅者占用无限的内存。
  */
-static const char *cities[] = {
-    "nanjing",
-    "beijing",
-    "shanghai",
-    "shenzhen"
-};
+#define MAX_BACKLOG  (64 * 1024)
+
+/**
+ * @brief 创建连接对象
+ * @return 引用计数为 1 的连接对象，由服务线程持有
+ *
+ * 连接编号在 TCP 与录入套接字之间统一分配。
+ */
+Connection *connection_new(void)
+{
+    static atomic_int count;
+
+    Connection *link = calloc(1, sizeof(Connection));
+    link->id = atomic_fetch_add(&count, 1);
+    link->length = sizeof(link->address);
+    atomic_init(&link->refcount, 1);
+    pthread_mutex_init(&link->send_lock, NULL);
+    pthread_mutex_init(&link->sub_lock, NULL);
+    return link;
+}
 
+/**
+ * @brief 增加连接的引用计数
+ */
+void connection_get(Connection *link)
+{
+    atomic_fetch_add(&link->refcount, 1);
+}
 
 /**
- * @brief 判断给定城市是否存在
- * @param 待判断的城市名
- * @return 如果城市存在，返回 1，否则返回 0
+ * @brief 减少连接的引用计数，归零时关闭套接字并释放
+ */
+void connection_put(Connection *link)
+{
+    if (atomic_fetch_sub(&link->refcount, 1) == 1) {
+        close(link->socket_fd);
+        pthread_mutex_destroy(&link->send_lock);
+        pthread_mutex_destroy(&link->sub_lock);
+        free(link->backlog);
+        free(link);
+    }
+}
+
+/**
+ * @brief 以不阻塞的方式发送一个完整报文
+ * @param link  连接信息
+ * @param iov   报文的各个片段
+ * @param n_iov 片段个数
+ * @return 已发出或已进入积压时返回 0，积压超限或连接出错时返回 -1
  *
- * 遍历实现
+ * 已有积压时报文直接追加到积压之后，保证同一连接上的报文不会交错。
+ * 积压由空变为非空时交给推送线程，在对端可写时继续发送。
+ * 返回 -1 时报文可能只发出了一部分，调用者应断开连接。
  */
-static int query_city(const char *city)
+int connection_send(Connection *link, const struct iovec *iov, int n_iov)
 {
-    for (long i = 0; i < sizeof(cities) / sizeof(cities[0]); i++) {
-        if (!strcmp(city, cities[i])) {
-            return 1;
+    size_t size = 0;
+    for (int i = 0; i < n_iov; i++) {
+        size += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&link->send_lock);
+
+    size_t n_sent = 0;
+    if (link->n_backlog == 0) {
+        struct msghdr message = { .msg_iov = (struct iovec *)iov, .msg_iovlen = (size_t)n_iov };
+        ssize_t n_send = sendmsg(link->socket_fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n_send < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            pthread_mutex_unlock(&link->send_lock);
+            return -1;
+        }
+        n_sent = n_send > 0 ? (size_t)n_send : 0;
+    }
+
+    if (n_sent < size) {
+        if (link->n_backlog + size - n_sent > MAX_BACKLOG) {
+            pthread_mutex_unlock(&link->send_lock);
+            return -1;
+        }
+        if (link->backlog == NULL) {
+            link->backlog = malloc(MAX_BACKLOG);
+        }
+
+        int was_empty = link->n_backlog == 0;
+        size_t skip = n_sent;
+        for (int i = 0; i < n_iov; i++) {
+            if (skip >= iov[i].iov_len) {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            memcpy(link->backlog + link->n_backlog, (const char *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+            link->n_backlog += iov[i].iov_len - skip;
+            skip = 0;
+        }
+        if (was_empty) {
+            subscription_backlog(link);
         }
     }
 
+    pthread_mutex_unlock(&link->send_lock);
     return 0;
 }
 
+/**
+ * @brief 判断连接是否允许录入天气
+ * @param link 连接信息
+ * @return 允许时返回 1，否则返回 0
+ *
+ * 只有经由录入套接字连接、且对端身份通过校验的连接才被视为数据源，
+ * TCP 连接无论来自哪个地址都不允许录入。
+ */
+static int ingest_allowed(const Connection *link)
+{
+    return link->trusted;
+}
 
 /**
- * @brief 天气服务的外层逻辑
- * @param arg 实际上是 Connection 指针，表示连接相关的信息
- * @return 返回 arg 自身
+ * @brief 接收并应用一批录入记录
+ * @param link     连接信息
+ * @param n_record 记录条数，来自请求报文的 date 字段
+ * @return 成功应用的记录数，接收失败时返回 -1
+ *
+ * 无论是否允许录入都会读完全部记录，以保持报文边界。
  */
-void *weather_service_main_loop(void *arg)
+static int ingest_records(Connection *link, uint8_t n_record)
 {
-    Connection *link = arg;
+    WeatherIngestRecord records[UINT8_MAX];
+    ssize_t size = (ssize_t)(n_record * sizeof(records[0]));
 
-    fprintf(stderr, "%d: service start\n", link->id);
+    if (size && recv(link->socket_fd, records, (size_t)size, MSG_WAITALL) != size) {
+        return -1;
+    }
 
-    ssize_t n_read;
-    CityRequestHeader request = {};
-    while ((n_read = recv(link->socket_fd, &request, sizeof(request), 0))) {
-        if (n_read < 0) {
-            perror("Failed to receive");
-            exit(-1);
-        }
+    if (!ingest_allowed(link)) {
+        return 0;
+    }
 
-        request_ntoh(&request);
-
-        CityResponseHeader response = {};
-        switch (request.type) {
-            case REQUEST_CITY:
-                response.type = (uint16_t)(query_city(request.city_name) ? RESPONSE_CITY_EXISTS : RESPONSE_NO_CITY);
-                break;
-            case REQUEST_SINGLE_DAY:
-                response.type = REQUEST_SINGLE_DAY;
-                response.status[0].weather_type = (uint8_t)(((unsigned)rand()) % NR_WEATHER);
-                response.status[0].temperature = (int8_t)rand();
-                break;
-            case REQUEST_MULTIPLE_DAY:
-                response.type = RESPONSE_MULTIPLE_DAY;
-                for (uint8_t i = 0; i < request.date; i++) {
-                    if (i >= sizeof(response.status) / sizeof(response.status[0])) {
-                        break;
-                    }
-                    response.status[i].weather_type = (uint8_t)(((unsigned)rand()) % NR_WEATHER);
-                    response.status[i].temperature = (int8_t)rand();
-                }
-                break;
-            default:
-                fprintf(stderr, "%d: unrecognized request type %x\n", link->id, request.type);
-                close(link->socket_fd);
-                exit(-1);
+    int n_applied = 0;
+    for (uint8_t i = 0; i < n_record; i++) {
+        WeatherIngestRecord *record = &records[i];
+        record->city_name[sizeof(record->city_name) - 1] = '\0';
+        int result = weather_store_update(record->city_name, record->date, record->weather_type, record->temperature);
+        if (result >= 0) {
+            n_applied++;
         }
+        if (result > 0 && record->date == 1) {
+            subscription_notify(record->city_name);
+        }
+    }
+    // 整批录入完成后再推送，同一连接的多条更新合并发送
+    subscription_flush();
+    return n_applied;
+}
+
+/**
+ * @brief 处理一个已解码的请求并发送响应
+ * @param link    连接信息
+ * @param request 请求报文，已转换为主机字节序，city_name 以 '\0' 结尾
+ * @param trace   本次请求的追踪记录，不采样时为 NULL
+ * @param mode    是否允许阻塞以及是否需要限速
+ * @return 继续服务时返回 0，连接结束时返回 -1，
+ *         mode 为 #RESPOND_NONBLOCKING 且需要等待上游时不发送响应，返回 1
+ *
+ * 强制内联到各个调用点：不采样的调用点 trace 恒为 NULL，mode 也是常量，
+ * 开启优化后各阶段的打点与不相干的分支都被消去，关闭追踪时只剩调用点前的一次判断。
+ */
+static inline __attribute__((always_inline)) int respond(Connection *link, const CityRequestHeader *request,
+                                                         TraceRecord *trace, RespondMode mode)
+{
+    CityResponseHeader response = {};
+    CityNameRecord names[MAX_PREFIX_MATCH];
+    int n_name = 0;
+
+    // 录入请求需要读完记录，受信任的数据源没有 IP 地址，都不参与限速；
+    // 按直接对端的 IP 计算，经由中继的客户端共用中继的令牌桶
+    if (mode != RESPOND_DEFERRED && request->type != REQUEST_INGEST && !link->trusted &&
+        !rate_limit_acquire(ntohl(link->address.sin_addr.s_addr))) {
+        construct_response(&response, request);
+        TRACE_STAMP(trace, TRACE_CONSTRUCT);
+        response.type = RESPONSE_THROTTLED;
+        goto reply;
+    }
+
+    if (mode == RESPOND_NONBLOCKING && request_would_block(request)) {
+        return 1;
+    }
+
+    if (handle_request(request, &response, trace) == 0) {
+        goto reply;
+    }
 
-        // 构造通用部分，转换字节序，发送
-        construct_response(&response, &request);
-        response_hton(&response);
-        ssize_t n_send = send(link->socket_fd, &response, sizeof(response), 0);
-        if (n_send != sizeof(response)) {
-            perror("Failed to send no city response");
+    switch (request->type) {
+        case REQUEST_INGEST: {
+            int n_applied = ingest_records(link, request->date);
+            if (n_applied < 0) {
+                perror("Failed to receive ingest records");
+                return -1;
+            }
+            response.type = (uint16_t)(ingest_allowed(link) ? RESPONSE_INGEST_DONE : RESPONSE_INGEST_DENY);
+            response.n_status = (uint8_t)n_applied;
+            break;
         }
+        case REQUEST_SUBSCRIBE:
+            if (!weather_store_contains(request->city_name)) {
+                response.type = RESPONSE_NO_CITY;
+            }
+            else {
+                response.type = (uint16_t)(subscription_add(link, request->city_name) == 0 ? RESPONSE_SUBSCRIBED : RESPONSE_SUBSCRIBE_FULL);
+            }
+            break;
+        case REQUEST_UNSUBSCRIBE:
+            subscription_remove(link, request->city_name);
+            response.type = RESPONSE_UNSUBSCRIBED;
+            break;
+        case REQUEST_PREFIX:
+            n_name = city_catalog_prefix(request->city_name, names, request->date < MAX_PREFIX_MATCH ? request->date : MAX_PREFIX_MATCH);
+            response.type = RESPONSE_PREFIX;
+            response.n_status = (uint8_t)n_name;
+            memset(response.status, 0, sizeof(response.status));
+            break;
+        default:
+            // 未知类型没有后续数据，报文边界不受影响，回复后继续服务
+            response.type = RESPONSE_UNSUPPORTED;
+            break;
+    }
+
+reply:
+    TRACE_STAMP(trace, TRACE_LOOKUP);
+
+    // 转换字节序，与前缀查询的结果一起发送，避免推送插入其间
+    response_hton(&response);
+    struct iovec iov[2] = {
+        { .iov_base = &response, .iov_len = sizeof(response) },
+        { .iov_base = names,     .iov_len = (size_t)n_name * sizeof(names[0]) }
+    };
+    if (connection_send(link, iov, n_name ? 2 : 1)) {
+        fprintf(stderr, "%d: client is not reading responses\n", link->id);
+        return -1;
+    }
+
+    if (trace) {
+        TRACE_STAMP(trace, TRACE_SEND);
+        trace->connection = link->id;
+        trace->type = request->type;
+        trace_commit(trace);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 接收并处理连接上的一个请求
+ * @param link  连接信息
+ * @param trace 本次请求的追踪记录，不采样时为 NULL
+ * @return 继续服务时返回 0，连接结束时返回 -1
+ */
+static inline __attribute__((always_inline)) int serve_request(Connection *link, TraceRecord *trace)
+{
+    CityRequestHeader request = {};
+
+    TRACE_STAMP(trace, TRACE_RECV_BEGIN);
+    ssize_t n_read = recv(link->socket_fd, &request, sizeof(request), 0);
+    if (n_read == 0) {
+        return -1;
+    }
+    if (n_read < 0) {
+        perror("Failed to receive");
+        exit(-1);
+    }
+    TRACE_STAMP(trace, TRACE_RECV_END);
+
+    request_ntoh(&request);
+    request.city_name[sizeof(request.city_name) - 1] = '\0';
+    TRACE_STAMP(trace, TRACE_DECODE);
+
+    return respond(link, &request, trace, RESPOND_BLOCKING);
+}
+
+/**
+ * @brief 处理连接上的一个请求，按采样间隔决定是否追踪
+ * @param link 连接信息
+ * @return 继续服务时返回 0，连接结束时返回 -1
+ */
+int weather_service_serve(Connection *link)
+{
+    if (__builtin_expect(trace_interval != 0, 0)) {
+        TraceRecord record;
+        return serve_request(link, trace_sample(&record));
+    }
+    else {
+        return serve_request(link, NULL);
+    }
+}
 
-        memset(&request, 0, sizeof(request));
+/**
+ * @brief 处理一个已解码的请求并发送响应，按采样间隔决定是否追踪
+ * @param link    连接信息
+ * @param request 请求报文，已转换为主机字节序，city_name 以 '\0' 结尾
+ * @param mode    #RESPOND_NONBLOCKING 或 #RESPOND_DEFERRED
+ * @return 继续服务时返回 0，连接结束时返回 -1，需要交给其它线程时返回 1
+ *
+ * 供自行接收请求的服务方式使用，录入请求的记录须已读完且连接不受信任。
+ * 采样时 recv 与 decode 阶段为零长度，只有之后的阶段有意义。
+ */
+int weather_service_respond(Connection *link, const CityRequestHeader *request, RespondMode mode)
+{
+    if (__builtin_expect(trace_interval != 0, 0) && mode == RESPOND_NONBLOCKING) {
+        TraceRecord record;
+        TraceRecord *trace = trace_sample(&record);
+        TRACE_STAMP(trace, TRACE_RECV_BEGIN);
+        TRACE_STAMP(trace, TRACE_RECV_END);
+        TRACE_STAMP(trace, TRACE_DECODE);
+        return respond(link, request, trace, RESPOND_NONBLOCKING);
     }
+    else if (mode == RESPOND_NONBLOCKING) {
+        return respond(link, request, NULL, RESPOND_NONBLOCKING);
+    }
+    else {
+        return respond(link, request, NULL, RESPOND_DEFERRED);
+    }
+}
 
+/**
+ * @brief 结束连接上的服务，释放服务方持有的引用
+ * @param link 连接信息
+ */
+void weather_service_close(Connection *link)
+{
     fprintf(stderr, "%d: service end\n", link->id);
-    close(link->socket_fd);
-    return arg;
+    subscription_drop(link);
+    shutdown(link->socket_fd, SHUT_RDWR);
+    connection_put(link);
+}
+
+/**
+ * @brief 天气服务的外层逻辑
+ * @param arg 实际上是 Connection 指针，表示连接相关的信息
+ * @return NULL，连接对象在此释放自己的引用
+ */
+void *weather_service_main_loop(void *arg)
+{
+    Connection *link = arg;
+    link->tid = pthread_self();
+
+    fprintf(stderr, "%d: service start\n", link->id);
+
+    while (weather_service_serve(link) == 0) {
+    }
+
+    weather_service_close(link);
+    return NULL;
 }
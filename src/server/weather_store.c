@@ -0,0 +1,455 @@
+/**
+ * @file     weather_store.c
+ * @author   whz
+ * @brief    分片的内存天气数据存储
+ *
+ * 城市按名称哈希分布到若干分片，每个分片是一张开放寻址表，表项为行编号。
+ * 行只增不删，写者持有分片锁串行化，读者完全不加锁：
+ * 通过 acquire 语义读取表项找到行，再用行内的顺序锁（seqlock）读取一致的数据。
+ * 因此 weather_service_main_loop 中的查询永远不会被录入阻塞。
+ *
+ * 每行保存最近 #NR_HISTORY_DAY 天的历史，组织成环形缓冲区：
+ * 每天占 11 位，低 3 位为天气类型，高 8 位为温度的补码，覆盖 int8_t 的全部取值，
+ * 写入的数据原样保存，不做截断。整行约 384 字节，十万个城市约 38MB。
+ * 环在写入时按日历天数惰性前滚，读者根据行的前滚日期换算日期距离，无需写入。
+ */
+
+#include <server/weather_store.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#define NR_SHARD      64
+#define SHARD_SLOT    8192
+#define MAX_ROW       (1 << 18)
+
+#define ENTRY_BITS    11
+#define WEATHER_BITS  3
+#define WEATHER_NONE  ((1 << WEATHER_BITS) - 1)
+
+/**
+ * @brief 打包数组的字节数，多留两个字节以便按 24 位读取最后一项
+ */
+#define PACKED_BYTES  ((NR_HISTORY_DAY * ENTRY_BITS + 7) / 8 + 2)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+/**
+ * @brief 一个城市的数据行
+ */
+typedef struct {
+    char              city_name[20];         /**< 城市名称，发布后不再修改 */
+    _Atomic uint32_t  seq;                   /**< 顺序锁计数，奇数表示正在写 */
+    uint32_t          day_stamp;             /**< 环最后一次前滚时的日序号 */
+    uint8_t           head;                  /**< day_stamp 当天在环中的位置 */
+    uint8_t           packed[PACKED_BYTES];  /**< 打包的环，距离 d 位于 head + d - 1 */
+} WeatherRow;
+
+/**
+ * @brief 分片
+ */
+typedef struct {
+    pthread_mutex_t   lock;                  /**< 串行化该分片的写者 */
+    _Atomic uint32_t *slot;                  /**< SHARD_SLOT 个表项，行编号加一，0 表示空 */
+} Shard;
+
+static Shard shards[NR_SHARD];
+
+/**
+ * @brief 全部分片的表项，连续存放，便于整体持久化
+ */
+static _Atomic uint32_t *slots;
+
+/**
+ * @brief 行数组，按 MAX_ROW 预留地址空间，用到时才分配物理页
+ */
+static WeatherRow *rows;
+
+static _Atomic uint32_t n_row;
+
+/**
+ * @brief 固定的城市集合
+ */
+static const char *cities[] = {
+    "nanjing",
+    "beijing",
+    "shanghai",
+    "shenzhen"
+};
+
+/**
+ * @brief 获取当前的本地日序号
+ * @return 自纪元起按本地时区计算的天数
+ *
+ * 缓存下一个午夜的时刻，只有跨过午夜时才调用 localtime_r。
+ */
+static uint32_t today_stamp(void)
+{
+    static _Atomic time_t next_midnight;
+    static _Atomic uint32_t today;
+
+    time_t now = time(NULL);
+    if (now < atomic_load_explicit(&next_midnight, memory_order_acquire)) {
+        return atomic_load_explicit(&today, memory_order_relaxed);
+    }
+
+    struct tm time_info;
+    localtime_r(&now, &time_info);
+    time_t local = now + time_info.tm_gmtoff;
+    uint32_t stamp = (uint32_t)(local / 86400);
+
+    atomic_store_explicit(&today, stamp, memory_order_relaxed);
+    atomic_store_explicit(&next_midnight, now + (86400 - local % 86400), memory_order_release);
+    return stamp;
+}
+
+/**
+ * @brief 读取环中某个位置的 11 位数据
+ */
+static unsigned get_entry(const uint8_t *packed, unsigned pos)
+{
+    unsigned bit = pos * ENTRY_BITS;
+    const uint8_t *p = &packed[bit / 8];
+    unsigned word = p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16;
+    return (word >> (bit % 8)) & ((1 << ENTRY_BITS) - 1);
+}
+
+/**
+ * @brief 写入环中某个位置的 11 位数据
+ */
+static void set_entry(uint8_t *packed, unsigned pos, unsigned entry)
+{
+    unsigned bit = pos * ENTRY_BITS;
+    uint8_t *p = &packed[bit / 8];
+    unsigned mask = ((1u << ENTRY_BITS) - 1) << (bit % 8);
+    unsigned word = p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16;
+    word = (word & ~mask) | (entry << (bit % 8));
+    p[0] = (uint8_t)word;
+    p[1] = (uint8_t)(word >> 8);
+    p[2] = (uint8_t)(word >> 16);
+}
+
+/**
+ * @brief 在分片中查找城市，不加锁
+ * @param shard 分片
+ * @param city  城市名
+ * @param h     城市名的哈希值
+ * @return 找到时返回行指针，否则返回 NULL
+ */
+static WeatherRow *find_row(Shard *shard, const char *city, uint32_t h)
+{
+    for (uint32_t i = 0; i < SHARD_SLOT; i++) {
+        uint32_t id = atomic_load_explicit(&shard->slot[(h + i) % SHARD_SLOT], memory_order_acquire);
+        if (id == 0) {
+            return NULL;
+        }
+        WeatherRow *row = &rows[id - 1];
+        if (!strncmp(row->city_name, city, sizeof(row->city_name))) {
+            return row;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 在分片中插入城市，调用者需持有分片锁
+ * @return 新行指针，空间耗尽时返回 NULL
+ */
+static WeatherRow *insert_row(Shard *shard, const char *city, uint32_t h)
+{
+    for (uint32_t i = 0; i < SHARD_SLOT; i++) {
+        _Atomic uint32_t *slot = &shard->slot[(h + i) % SHARD_SLOT];
+        if (atomic_load_explicit(slot, memory_order_relaxed) != 0) {
+            continue;
+        }
+
+        uint32_t id = atomic_fetch_add_explicit(&n_row, 1, memory_order_relaxed);
+        if (id >= MAX_ROW) {
+            return NULL;
+        }
+
+        WeatherRow *row = &rows[id];
+        strncpy(row->city_name, city, sizeof(row->city_name) - 1);
+        row->day_stamp = today_stamp();
+        for (unsigned pos = 0; pos < NR_HISTORY_DAY; pos++) {
+            set_entry(row->packed, pos, WEATHER_NONE);
+        }
+        // release 保证读者看到表项时，行已经初始化完毕
+        atomic_store_explicit(slot, id + 1, memory_order_release);
+        return row;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 将环前滚到指定日期，新进入的天数标记为没有数据
+ * @param row   数据行，调用者需处于写临界区
+ * @param stamp 目标日序号
+ */
+static void roll_forward(WeatherRow *row, uint32_t stamp)
+{
+    if (stamp <= row->day_stamp) {
+        return;
+    }
+
+    uint32_t n_day = stamp - row->day_stamp;
+    if (n_day > NR_HISTORY_DAY) {
+        n_day = NR_HISTORY_DAY;
+    }
+    for (uint32_t i = 0; i < n_day; i++) {
+        row->head = (uint8_t)((row->head + NR_HISTORY_DAY - 1) % NR_HISTORY_DAY);
+        set_entry(row->packed, row->head, WEATHER_NONE);
+    }
+    row->day_stamp = stamp;
+}
+
+/**
+ * @brief 初始化存储
+ *
+ * 预留表项与行数组的地址空间，不填充数据。
+ */
+void weather_store_init(void)
+{
+    slots = mmap(NULL, (size_t)NR_SHARD * SHARD_SLOT * sizeof(*slots), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    rows = mmap(NULL, (size_t)MAX_ROW * sizeof(*rows), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slots == MAP_FAILED || rows == MAP_FAILED) {
+        perror("Cannot reserve weather store");
+        exit(-1);
+    }
+
+    for (int i = 0; i < NR_SHARD; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].slot = slots + (size_t)i * SHARD_SLOT;
+    }
+}
+
+/**
+ * @brief 为固定城市集合生成初始数据
+ *
+ * 固定城市填入随机游走的历史数据，保持与原先随机响应相同的行为。
+ */
+void weather_store_seed(void)
+{
+    for (long i = 0; i < sizeof(cities) / sizeof(cities[0]); i++) {
+        int temperature = 15;
+        for (uint8_t day = 1; day <= NR_HISTORY_DAY && day != 0; day++) {
+            temperature += (int)(((unsigned)rand()) % 7) - 3;
+            temperature = temperature < -10 ? -10 : temperature > 40 ? 40 : temperature;
+            weather_store_update(cities[i], day, (uint8_t)(((unsigned)rand()) % NR_WEATHER), (int8_t)temperature);
+        }
+    }
+}
+
+/**
+ * @brief 获取存储的内存布局
+ * @param layout 输出参数
+ */
+void weather_store_layout(WeatherStoreLayout *layout)
+{
+    layout->index = (void *)slots;
+    layout->index_size = (size_t)NR_SHARD * SHARD_SLOT * sizeof(*slots);
+    layout->rows = rows;
+    layout->row_size = sizeof(*rows);
+    layout->max_row = MAX_ROW;
+}
+
+/**
+ * @brief 复制一份表项，并返回此时已分配的行数
+ * @param index 输出缓冲区，大小为 WeatherStoreLayout::index_size
+ * @return 已分配的行数，编号小于它的行都已在复制到的表项中发布
+ *
+ * 插入都在分片锁下完成，持有全部分片锁时表项与行数是一致的：
+ * 不会有行已经分配编号、表项却还没写入。只阻塞写者，复制期间查询照常进行。
+ */
+uint32_t weather_store_copy_index(void *index)
+{
+    for (int i = 0; i < NR_SHARD; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+    }
+
+    uint32_t *out = index;
+    for (size_t i = 0; i < (size_t)NR_SHARD * SHARD_SLOT; i++) {
+        out[i] = atomic_load_explicit(&slots[i], memory_order_relaxed);
+    }
+    uint32_t count = atomic_load_explicit(&n_row, memory_order_relaxed);
+
+    for (int i = NR_SHARD - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+
+    return count < MAX_ROW ? count : MAX_ROW;
+}
+
+/**
+ * @brief 在顺序锁保护下复制一行
+ * @param id  行编号
+ * @param row 输出缓冲区，大小为 WeatherStoreLayout::row_size
+ */
+void weather_store_copy_row(uint32_t id, void *row)
+{
+    WeatherRow *src = &rows[id];
+    uint32_t begin;
+    do {
+        while ((begin = atomic_load_explicit(&src->seq, memory_order_acquire)) & 1) {
+            cpu_relax();
+        }
+        memcpy(row, src, sizeof(*src));
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&src->seq, memory_order_relaxed) != begin);
+}
+
+/**
+ * @brief 接管已经映射到布局地址上的数据
+ * @param count 已有的行数
+ *
+ * 调用者负责在处理请求之前，把表项和行映射到 weather_store_layout() 给出的地址。
+ */
+void weather_store_adopt(uint32_t count)
+{
+    atomic_store_explicit(&n_row, count, memory_order_release);
+}
+
+/**
+ * @brief 获取已分配的行数
+ * @return 行数，编号小于该值的行都已分配，但可能尚未发布
+ */
+uint32_t weather_store_count(void)
+{
+    uint32_t count = atomic_load_explicit(&n_row, memory_order_acquire);
+    return count < MAX_ROW ? count : MAX_ROW;
+}
+
+/**
+ * @brief 读取一行的城市名
+ * @param id   行编号，小于 weather_store_count()
+ * @param name 输出的城市名
+ * @return 成功时返回 0，该行尚未发布时返回 -1
+ *
+ * 行的编号先于表项分配，插入者写完城市名才发布表项。
+ * 复制出的名字能通过表项找回同一行，说明复制时该行已经发布。
+ */
+int weather_store_row_name(uint32_t id, char name[20])
+{
+    memcpy(name, rows[id].city_name, sizeof(rows[id].city_name));
+    name[sizeof(rows[id].city_name) - 1] = '\0';
+
+    uint32_t h = city_hash(name);
+    if (name[0] != '\0' && find_row(&shards[h % NR_SHARD], name, h / NR_SHARD) == &rows[id]) {
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief 判断给定城市是否存在
+ * @param city 待判断的城市名
+ * @return 如果城市存在，返回 1，否则返回 0
+ */
+int weather_store_contains(const char *city)
+{
+    uint32_t h = city_hash(city);
+    return find_row(&shards[h % NR_SHARD], city, h / NR_SHARD) != NULL;
+}
+
+/**
+ * @brief 读取城市连续若干天的天气
+ * @param city      城市名
+ * @param first_day 起始日期距离，1 表示今天
+ * @param n_day     天数
+ * @param out       输出数组，至少 n_day 个元素
+ * @return 成功时返回 0，城市不存在时返回 -1，有某天没有数据时返回 -2
+ *
+ * 读者不加锁，遇到并发写入时重试。
+ */
+int weather_store_lookup(const char *city, uint8_t first_day, uint8_t n_day, WeatherStatus *out)
+{
+    uint32_t h = city_hash(city);
+    WeatherRow *row = find_row(&shards[h % NR_SHARD], city, h / NR_SHARD);
+    if (row == NULL) {
+        return -1;
+    }
+
+    if (first_day == 0 || first_day + n_day - 1 > NR_HISTORY_DAY) {
+        return -2;
+    }
+
+    WeatherRow copy;
+    uint32_t begin;
+    do {
+        while ((begin = atomic_load_explicit(&row->seq, memory_order_acquire)) & 1) {
+            cpu_relax();
+        }
+        memcpy(&copy.day_stamp, &row->day_stamp, sizeof(copy) - offsetof(WeatherRow, day_stamp));
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&row->seq, memory_order_relaxed) != begin);
+
+    // 行上次前滚之后经过的天数，这些天在行内还没有数据
+    uint32_t today = today_stamp();
+    uint32_t elapsed = today > copy.day_stamp ? today - copy.day_stamp : 0;
+    for (uint8_t i = 0; i < n_day; i++) {
+        uint32_t distance = first_day + i;
+        if (distance <= elapsed || distance - elapsed > NR_HISTORY_DAY) {
+            return -2;
+        }
+        unsigned entry = get_entry(copy.packed, (copy.head + distance - elapsed - 1) % NR_HISTORY_DAY);
+        if ((entry & WEATHER_NONE) == WEATHER_NONE) {
+            return -2;
+        }
+        out[i].weather_type = (uint8_t)(entry & WEATHER_NONE);
+        out[i].temperature = (int8_t)(uint8_t)(entry >> WEATHER_BITS);
+    }
+    return 0;
+}
+
+/**
+ * @brief 更新城市某天的天气
+ * @param city         城市名
+ * @param date         日期距离，1 表示今天
+ * @param weather_type 天气类型
+ * @param temperature  温度
+ * @return 数据发生变化时返回 1，与原数据相同时返回 0，参数非法或空间耗尽时返回 -1
+ */
+int weather_store_update(const char *city, uint8_t date, uint8_t weather_type, int8_t temperature)
+{
+    if (date == 0 || date > NR_HISTORY_DAY || weather_type >= NR_WEATHER || city[0] == '\0') {
+        return -1;
+    }
+
+    uint32_t h = city_hash(city);
+    Shard *shard = &shards[h % NR_SHARD];
+
+    pthread_mutex_lock(&shard->lock);
+
+    WeatherRow *row = find_row(shard, city, h / NR_SHARD);
+    if (row == NULL) {
+        row = insert_row(shard, city, h / NR_SHARD);
+    }
+    if (row == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    uint32_t seq = atomic_load_explicit(&row->seq, memory_order_relaxed);
+    atomic_store_explicit(&row->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    roll_forward(row, today_stamp());
+    unsigned pos = (row->head + date - 1u) % NR_HISTORY_DAY;
+    unsigned entry = weather_type | (unsigned)(uint8_t)temperature << WEATHER_BITS;
+    int changed = get_entry(row->packed, pos) != entry;
+    set_entry(row->packed, pos, entry);
+    atomic_store_explicit(&row->seq, seq + 2, memory_order_release);
+
+    pthread_mutex_unlock(&shard->lock);
+    return changed;
+}